@@ -1,4 +1,6 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <ctype.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
@@ -6,6 +8,19 @@
 #include <sys/wait.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <stdarg.h>
+#include <libgen.h>
+#include <limits.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 
 // Define global constants
 #define MAXLINELENGTH 1024
@@ -13,6 +28,50 @@
 #define MAXARGLEN 128
 #define MAXPATHNUM 32
 #define MAXPATHSIZE 512
+#define MAXSEGNUM 64
+
+#define SUBSTMAXSIZE (MAXARGNUM * MAXARGLEN)
+#define MAXEXPANDEDWORDS (MAXARGNUM * 8)
+#define LOOKAHEADLINES 8
+#define PATHCACHESIZE 64
+
+// Define streaming constants
+#define SCANBLOCKSIZE (1 << 20)
+#define MAXLOOPVARS 32
+
+// Define timeout constants (milliseconds)
+#define KILLGRACEMS 2000
+#define REAPPOLLMS 10
+
+// Define profiler constants
+#define PROFILETOPN 20
+#define PROFILEREPORTSUFFIX ".txt"
+#define PROFILEPARSE 0
+#define PROFILEVALIDATE 1
+#define PROFILESPAWN 2
+#define PROFILERUN 3
+#define PROFILEPHASES 4
+
+// Define journal constants
+#define JOURNALSUFFIX ".journal"
+#define JOURNALMAGIC "lsh-journal 2"
+#define JOURNALSYNCRECORDS 256
+#define JOURNALSYNCMS 1000
+#define JOURNALSTATESIZE (MAXPATHNUM * (MAXARGLEN + 4) + MAXPATHSIZE + 64)
+#define JOURNALOFF 0
+#define JOURNALON 1
+#define JOURNALRESUME 2
+
+// Define concurrency controller constants
+#define CONCURRENCYOFF 0
+#define CONCURRENCYFIXED 1
+#define CONCURRENCYAUTO 2
+#define CONTROLINTERVALMS 1000
+#define PRESSUREWINDOWMS 10000 // The window that the avg10 pressure is averaged over.
+#define CPUPRESSURELIMIT 25.0
+#define MEMORYPRESSURELIMIT 10.0
+#define IOPRESSURELIMIT 25.0
+#define LOADPERCPULIMIT 1.5
 
 // Define strings constants
 #define QUERYSTR "lsh> "
@@ -33,14 +92,219 @@ int mode;
 FILE *in_stream;
 FILE *out_stream;
 
+// For here-documents and here-strings, the sealed memfd feeding each segment of the current line.
+int segment_stdin[MAXSEGNUM];
+
+// Words produced by expanding the groups that are running. They are plain arguments, even if they look like
+// operators.
+char *expanded_words[MAXEXPANDEDWORDS];
+int expanded_word_count = 0;
+
+// For exit statuses and fail-fast runs.
+int last_status = 0;
+bool fail_fast = false;
+bool own_process_groups = false;
+
+// For stopping the children when the shell is interrupted.
+volatile sig_atomic_t caught_signal = 0;
+struct segment *active_segments = NULL;
+int active_segment_count = 0;
+
+// For command deadlines and hedging.
+long default_timeout_ms = 0;
+int hedge_percentile = 0;
+
+// A single forked copy of a command segment.
+struct attempt
+{
+  pid_t pid;
+  int pidfd;
+  bool live;
+  int out_fd;
+  int err_fd;
+};
+
+// A command segment delimited by '&', along with the state used to supervise it.
+struct segment
+{
+  int index;
+  int argc;
+  char **argv;
+  int stdin_fd;
+  long timeout_ms;
+  int timerfd;
+  int timer_stage;
+  struct attempt attempts[2];
+  int attempt_count;
+  struct attempt helper;
+  bool capture;
+  int winner;
+  bool launched;
+  bool exited;
+  bool done;
+  int status;
+  int helper_status;
+  struct timespec start;
+  struct timespec spawned;
+  struct timespec end;
+  struct rusage usage;
+};
+
+// A streaming compressor for redirect targets with a given suffix.
+struct compressor
+{
+  const char *suffix;
+  char *argv[5];
+};
+
+// Accumulated timings for one profiler key.
+struct profile_entry
+{
+  char *key;
+  int line;
+  long count;
+  long usec[PROFILEPHASES];
+  long user_usec;
+  long sys_usec;
+  long maxrss;
+};
+
+// An open addressing hash table of profiler entries.
+struct profile_table
+{
+  struct profile_entry *entries;
+  size_t capacity;
+  size_t size;
+};
+
+// Streaming compressors, in order of preference for each suffix.
+struct compressor compressors[] = {
+    {".gz", {"pigz", "-c", NULL}},
+    {".gz", {"gzip", "-c", NULL}},
+    {".zst", {"zstd", "-q", "-c", "-T0", NULL}},
+};
+#define COMPRESSORNUM (sizeof(compressors) / sizeof(compressors[0]))
+
+// The state of the concurrency controller, which limits how many segments of a line run at once.
+struct controller
+{
+  int mode;
+  int limit;
+  int cpus;
+  bool sampled;
+  struct timespec last_sample;
+  double cpu;
+  double memory;
+  double io;
+  double load;
+  const char *decision;
+  long increases;
+  long decreases;
+  bool decreased;
+  struct timespec last_decrease;
+};
+struct controller concurrency = {CONCURRENCYOFF, MAXSEGNUM, 1, false, {0, 0}, -1, -1, -1, -1, "none", 0, 0, false, {0, 0}};
+
+// For the batch-script profiler.
+char *profile_path = NULL;
+const char *profile_script = "lsh";
+int line_number = 0;
+int input_lines = 0; // The physical lines read from the input so far, including here-documents and loop bodies.
+char line_text[MAXLINELENGTH];
+struct profile_table profile_lines;
+struct profile_table profile_commands;
+const char *profile_phase_names[PROFILEPHASES] = {"parse", "validate", "spawn", "run"};
+
+// A batch file line that has been read ahead of time.
+struct pending_line
+{
+  int argc;
+  char *array[MAXARGNUM];
+  int stdin_fds[MAXSEGNUM];
+  char *loop_body;
+  long parse_usec;
+  int number;
+};
+
+// A resolved executable, valid while the program paths and working directory are unchanged.
+struct path_cache_entry
+{
+  char *cmd;
+  char *fpath;
+  long generation;
+};
+
+// For reading ahead in batch mode.
+struct pending_line lookahead[LOOKAHEADLINES];
+int lookahead_head = 0;
+int lookahead_count = 0;
+bool lookahead_blocked = false;
+bool prefetching = false;
+long path_generation = 0;
+struct path_cache_entry path_cache[PATHCACHESIZE];
+
+// A reader that hands out blocks of whole lines from a file, for the streaming built-in commands.
+struct line_scanner
+{
+  int fd;
+  char *buf;
+  size_t capacity;
+  size_t start;
+  size_t end;
+  bool eof;
+};
+
+// A variable set by a 'while read' loop.
+struct loop_variable
+{
+  const char *name;
+  const char *value;
+};
+
+// For 'while read' loops: the body of the loop on the current line, and the variables of the running loops.
+char *loop_body = NULL;
+struct loop_variable loop_variables[MAXLOOPVARS];
+int loop_variable_count = 0;
+int loop_depth = 0;
+
+// The exit status of the last built-in command, for those that have one.
+int builtin_status = 0;
+
+// For the execution journal.
+int journal_mode = JOURNALOFF;
+int journal_fd = -1;
+int journal_pending = 0;
+struct timespec journal_pending_since;
+char journal_state[JOURNALSTATESIZE];
+int resume_done_line = 0;
+int resume_partial_line = 0;
+uint64_t resume_partial_mask = 0;
+
 // Funtion Defenitions (This may not be the right name for this 'procedure')
 // TODO Comment and order these functions.
 // TODO Switch return values to 'bool' where possible.
 // TODO Create more functionality to register validity of path, permissions, and permissions variables/modes.
 int close_input();
+int parse_shell_options(int argc, char *argv[]);
 int set_input_mode(int argc, char *argv[]);
 int parse_input_line(char *array[], FILE *stream);
+ssize_t read_input_line(char **line, size_t *len, FILE *stream);
+int parse_line_text(char *line, char *array[], FILE *stream, int stdin_fds[], char **body);
+int split_words(char *text, char *words[], int max);
+int lookahead_step();
+int next_lookahead_line(char *array[], long *parse_usec, int *number);
+void prefetch_binary(const char *fpath);
 int sub_parse(const char *input, char *del[], char *array[], int *index);
+int expand_arguments(int argc, char *argv[], char *expanded[], int max);
+bool is_operator(const char *arg, const char *op);
+char *expand_substitutions(const char *input);
+char *run_substitution(const char *cmd);
+int create_sealed_memfd(const char *data, size_t len);
+int read_here_document(const char *delimiter, FILE *stream);
+int collect_input_documents(int argc, char *array[], FILE *stream, int stdin_fds[]);
+void close_input_documents();
+char *read_loop_body(FILE *stream);
+int loop_nesting(const char *line, size_t len);
 void print_error_message();
 void print_query_message();
 int get_current_working_directory();
@@ -49,28 +313,112 @@ char *validate_path(char *cmd);
 int register_built_in_commands(int argc, char *argv[]);
 const char *get_file_suffix(const char *path);
 void register_arguments(int argc, char *argv[]);
+bool is_list_operator(const char *token);
+int validate_list_format(int argc, char *argv[]);
+int count_segments(int argc, char *argv[]);
+int run_command_group(int argc, char *argv[], int first_index, bool cancel_on_failure);
+int run_expanded_group(int argc, char *argv[], int first_index, bool cancel_on_failure);
+int exit_code(int status);
 int validate_input_format(int argc, char *argv[]);
 int validate_io_redirect_format(int argc, char *argv[]);
-int execute_programs(int argc, char *argv[]);
+bool has_compressed_suffix(const char *path);
+char *find_compressor(const char *path, struct compressor **found);
+long parse_duration(const char *str);
+int parse_segment_prefix(int argc, char *argv[], long *timeout_ms);
+int execute_programs(int argc, char *argv[], int first_index, bool cancel_on_failure);
+int launch_attempt(struct segment *seg);
+int launch_compressor(struct segment *seg, int *pipe_fd);
+int signal_attempt(struct attempt *att, int sig);
+int arm_segment_timer(struct segment *seg, long ms);
+void handle_segment_timer(struct segment *seg);
+int reap_segment_attempts(struct segment *seg);
+void hedge_stragglers(struct segment segments[], int n, int completed);
+void flush_captured_output(struct segment *seg);
+int wait_for_segments(struct segment segments[], int n, bool cancel_on_failure);
+void cancel_segments(struct segment segments[], int n);
+void install_signal_handlers();
+void handle_termination_signal(int sig);
+void finish_on_signal(int sig);
+void launch_pending_segments(struct segment segments[], int n, int running);
+int count_running(struct segment segments[], int n);
+double read_pressure(const char *resource);
+void sample_concurrency(int running);
+long elapsed_usec(const struct timespec *from, const struct timespec *to);
+void set_line_text(int argc, char *argv[]);
+struct profile_entry *profile_lookup(struct profile_table *table, const char *key);
+void profile_record_phase(const char *cmd, int phase, long usec);
+void profile_record_segment(struct segment *seg);
+int compare_profile_entries(const void *a, const void *b);
+void write_profile_section(FILE *out, struct profile_table *table, const char *title);
+int write_profile();
+void build_journal_state(char *state);
+int open_journal(const char *script);
+int read_journal(int fd, struct stat *script_stat);
+int restore_journal_state(const char *state);
+void journal_record(const char *format, ...);
+long journal_flush(bool force);
+void journal_line_done();
+void close_journal();
+int register_while_command(int argc, char *argv[]);
+int register_count_command(int argc, char *argv[]);
+int register_match_command(int argc, char *argv[]);
+int register_fields_command(int argc, char *argv[]);
+void split_loop_line(char *line, int first, int vars);
+void run_loop_body(const char *body);
+char *expand_variables(const char *word);
+void write_expanded_variables(FILE *out, const char *text, size_t len);
+FILE *open_builtin_output(int *argc, char *argv[]);
+void close_builtin_output(FILE *out);
+int open_line_scanner(struct line_scanner *sc, const char *path);
+int next_line_block(struct line_scanner *sc, char **block, size_t *len);
+void close_line_scanner(struct line_scanner *sc);
+size_t count_byte(const char *data, size_t len, char c);
+void free_arguments(int argc, char *argv[]);
 void clean_memory(int argc, char *argv[]);
 
 // Program Main.
 int main(int argc, char *argv[])
 {
+  // Read any options given before the batch file.
+  int first = parse_shell_options(argc, argv);
+
   // Make sure the right number of args are passed.
-  if (argc > 2)
+  if (first == -1 || argc - first > 1)
   {
     print_error_message();
     return 1;
   }
 
   // Set the input mode.
-  if (set_input_mode(argc, argv) == 0)
+  if (set_input_mode(argc - first + 1, &argv[first - 1]) == 0)
   {
     print_error_message();
     return 1;
   }
 
+  // Name the profile after the batch file.
+  if (mode == BATCHMODE)
+  {
+    const char *slash = strrchr(argv[first], '/');
+    profile_script = (slash != NULL) ? slash + 1 : argv[first];
+  }
+
+  // Children get their own process groups so they can be cancelled with everything they started. This is only
+  // done when the shell is not reading a terminal, where children must stay in the foreground process group.
+  own_process_groups = !isatty(STDIN_FILENO);
+  install_signal_handlers();
+
+  // Size the concurrency controller for this host.
+  concurrency.cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (concurrency.cpus < 1)
+    concurrency.cpus = 1;
+
+  // No segment has an input document yet.
+  for (int i = 0; i < MAXSEGNUM; i++)
+  {
+    segment_stdin[i] = -1;
+  }
+
   // Set the default program paths and the path count.
   program_paths[0] = strdup("");
   program_paths[1] = strdup("/bin/");
@@ -81,6 +429,13 @@ int main(int argc, char *argv[])
   if (get_current_working_directory() == 0)
     return 0;
 
+  // Open the journal, picking up where a previous run stopped when resuming.
+  if (journal_mode != JOURNALOFF && (mode != BATCHMODE || open_journal(argv[first]) == 0))
+  {
+    print_error_message();
+    return 1;
+  }
+
   // Open an event loop.
   while (1)
   {
@@ -88,7 +443,7 @@ int main(int argc, char *argv[])
     char *array[MAXARGNUM];
 
     // Check for end-of-file.
-    if (feof(in_stream))
+    if (lookahead_count == 0 && feof(in_stream))
     {
       // Deallocate the old program paths.
       for (int i = 0; i < program_path_count; i++)
@@ -96,16 +451,49 @@ int main(int argc, char *argv[])
         free(program_paths[i]);
       }
 
-      // exit the program.
+      // exit the program with the status of the last command.
+      write_profile();
+      close_journal();
       close_input();
-      exit(0);
+      exit(last_status);
+    }
+
+    // Get next command input, which may have been read ahead.
+    struct timespec parse_start, parse_end;
+    long parse_usec;
+    int new_argc;
+    int number;
+    if (lookahead_count > 0)
+    {
+      new_argc = next_lookahead_line(array, &parse_usec, &number);
+    }
+    else
+    {
+      number = input_lines + 1;
+      clock_gettime(CLOCK_MONOTONIC, &parse_start);
+      new_argc = get_user_input(array, in_stream);
+      clock_gettime(CLOCK_MONOTONIC, &parse_end);
+      parse_usec = elapsed_usec(&parse_start, &parse_end);
     }
 
-    // Get next command input.
-    int new_argc = get_user_input(array, in_stream);
+    // Lines are numbered by where they start in the input. Skip lines that a previous run has already completed.
+    line_number = number;
+    if (line_number > resume_done_line)
+    {
+      // Record how long the line took to read and parse.
+      if (profile_path != NULL && new_argc > 0)
+      {
+        set_line_text(new_argc, array);
+        profile_record_phase(NULL, PROFILEPARSE, parse_usec);
+      }
 
-    // register argument values.
-    register_arguments(new_argc, array);
+      // register argument values.
+      register_arguments(new_argc, array);
+      journal_line_done();
+    }
+    close_input_documents();
+    free(loop_body);
+    loop_body = NULL;
 
     // clear alloced memory for arguments
     for (int i = 0; i < new_argc; i++)
@@ -153,10 +541,56 @@ int set_input_mode(int argc, char *argv[])
     {
       return 0;
     }
+
+    // Reading ahead would block on a pipe until its next line is written, so only read ahead in regular files.
+    struct stat st;
+    if (fstat(fileno(in_stream), &st) == -1 || !S_ISREG(st.st_mode))
+      lookahead_blocked = true;
   }
   return 1;
 }
 
+/**
+ * Read the options given to the shell before the batch file. The options are:
+ *    --profile FILE: write a profile of the run to FILE when the shell exits.
+ *    --journal: record the progress of the batch file in a journal next to it.
+ *    --resume: like --journal, but skip the work that the journal shows was already completed.
+ *
+ * Input:
+ *    int argc: the number of arguments passed to main.
+ *    char *argv[]: the arguments passed to main.
+ *
+ * Output:
+ *    The index of the first argument after the options, or -1 if an option is invalid.
+ */
+int parse_shell_options(int argc, char *argv[])
+{
+  int i = 1;
+  while (i < argc && strncmp(argv[i], "--", 2) == 0)
+  {
+    if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc)
+    {
+      profile_path = argv[i + 1];
+      i += 2;
+    }
+    else if (strcmp(argv[i], "--journal") == 0)
+    {
+      journal_mode = JOURNALON;
+      i++;
+    }
+    else if (strcmp(argv[i], "--resume") == 0)
+    {
+      journal_mode = JOURNALRESUME;
+      i++;
+    }
+    else
+    {
+      return -1;
+    }
+  }
+  return i;
+}
+
 /**
  * If the input stream was opened at the beginning of the program, then it is closed.
  */
@@ -186,7 +620,7 @@ int parse_input_line(char *array[], FILE *stream)
   ssize_t nread;
 
   // Get the input line.
-  if ((nread = getline(&line, &len, stream)) == -1)
+  if ((nread = read_input_line(&line, &len, stream)) == -1)
   {
     free(line);
     if (!feof(stream))
@@ -205,34 +639,91 @@ int parse_input_line(char *array[], FILE *stream)
     free(line);
     return 0;
   }
-  // Start the string parser.
-  char *in_Ptr = line;
-  char *o_Ptr;
+
+  return parse_line_text(line, array, stream, segment_stdin, &loop_body);
+}
+
+/**
+ * Read one physical line of the input, counting it so that lines can be numbered by where they start, even when
+ * here-documents and loop bodies are read along with them.
+ *
+ * Input:
+ *    char **line: the buffer to read into, as for getline.
+ *    size_t *len: the size of the buffer, as for getline.
+ *    FILE *stream: the stream to read from.
+ *
+ * Output:
+ *    The number of characters read, or -1 at the end of the stream or on an error.
+ */
+ssize_t read_input_line(char **line, size_t *len, FILE *stream)
+{
+  ssize_t nread = getline(line, len, stream);
+  if (nread != -1)
+    input_lines++;
+  return nread;
+}
+
+/**
+ * Given the text of a line, this will split it into arguments. A word with a command substitution is kept whole,
+ * without being split at operators, and is only expanded when its group runs. Here-documents and the body of a
+ * 'while' loop are read from the stream after the line. The line is freed.
+ *
+ * Input:
+ *    char *line: the alloced text of the line.
+ *    char *array[]: a fixed size (MAXLINELENGTH) array of character strings.
+ *    FILE *restrict stream: the stream the line was read from, or NULL if the line has nothing after it to read.
+ *    int stdin_fds[]: where the input documents of each segment are stored.
+ *    char **body: where the body of a loop is stored, or NULL to leave a loop's body unread.
+ *
+ * Output:
+ *    The number of arguments on the line, or -1 if there was an error.
+ */
+int parse_line_text(char *line, char *array[], FILE *stream, int stdin_fds[], char **body)
+{
+  // Split the line into words, keeping command substitutions whole.
+  char *words[MAXARGNUM];
+  int count = split_words(line, words, MAXARGNUM - 1);
+  if (count == -1)
+  {
+    free(line);
+    return -1;
+  }
   int i = 0;
 
   // Store each seperated string in the array.
-  while ((o_Ptr = strsep(&in_Ptr, " \r\n\t")) != NULL)
+  for (int w = 0; w < count; w++)
   {
+    char *o_Ptr = words[w];
+
     // check that we have a valid number of arguments.
     if (i + 1 >= MAXARGNUM)
       return 0; // Failure.
 
+    // Keep a command substitution as it is.
+    if (strstr(o_Ptr, "$(") != NULL && strlen(o_Ptr) + 1 <= MAXARGLEN)
+    {
+      array[i++] = strdup(o_Ptr);
+    }
     // update the new argument.
-    if ((strcmp(o_Ptr, "") != 0) && (strlen(o_Ptr) + 1 <= MAXARGLEN))
+    else if (strlen(o_Ptr) + 1 <= MAXARGLEN)
     {
       // Add the next valid (non-empty) string.
       // Parse by these values.
-      char *del[2];
+      char *del[5];
       del[0] = strdup(">");
       del[1] = strdup("&");
-      del[2] = NULL;
+      del[2] = strdup(";");
+      del[3] = strdup("|");
+      del[4] = NULL;
 
       // Add parsed values.
       int parse_res = sub_parse(o_Ptr, del, array, &i);
 
       // Free values used for parsing.
-      free(del[0]);
-      free(del[1]);
+      for (int j = 0; del[j] != NULL; j++)
+      {
+        free(del[j]);
+      }
 
       // Check if parse failed.
       if (parse_res == 0)
@@ -244,13 +735,181 @@ int parse_input_line(char *array[], FILE *stream)
   array[i] = NULL;
 
   free(line); // Free alloced line.
-  return i;   // Success.
+
+  // Take out any here-documents and here-strings.
+  int argc = collect_input_documents(i, array, stream, stdin_fds);
+
+  // Read the body of a loop, up to its 'done'.
+  if (argc > 0 && body != NULL && stream != NULL && strcmp(array[0], "while") == 0)
+  {
+    *body = read_loop_body(stream);
+    if (*body == NULL)
+    {
+      for (int j = 0; j < argc; j++)
+      {
+        free(array[j]);
+      }
+      return -1;
+    }
+  }
+  return argc;
+}
+
+/**
+ * Split text into words at whitespace, in place. A command substitution is kept whole in its word, even if it
+ * holds whitespace.
+ *
+ * Input:
+ *    char *text: the text to split.
+ *    char *words[]: where the words are stored.
+ *    int max: the most words to store.
+ *
+ * Output:
+ *    The number of words, or -1 if a substitution is not closed or there are too many words.
+ */
+int split_words(char *text, char *words[], int max)
+{
+  int count = 0;
+  char *c = text;
+  while (1)
+  {
+    while (*c != '\0' && isspace((unsigned char)*c))
+      c++;
+    if (*c == '\0')
+      return count;
+    if (count == max)
+      return -1;
+    words[count++] = c;
+
+    // Find the end of the word, skipping over substitutions.
+    int depth = 0;
+    while (*c != '\0' && (depth > 0 || !isspace((unsigned char)*c)))
+    {
+      if (c[0] == '$' && c[1] == '(')
+      {
+        depth++;
+        c++;
+      }
+      else if (*c == '(' && depth > 0)
+        depth++;
+      else if (*c == ')' && depth > 0)
+        depth--;
+      c++;
+    }
+    if (depth > 0)
+      return -1;
+    if (*c != '\0')
+      *c++ = '\0';
+  }
+}
+
+/**
+ * In batch mode, read, parse and validate one more line ahead of the line that is running. Validating the line
+ * resolves its executables, which are cached and prefetched, so the line can start as soon as its turn comes.
+ * Command substitutions are not run until the line is reached.
+ *
+ * Output:
+ *    1 - If a line was read ahead.
+ *    0 - If there is nothing to read ahead.
+ */
+int lookahead_step()
+{
+  if (mode != BATCHMODE || lookahead_blocked || lookahead_count == LOOKAHEADLINES || feof(in_stream))
+    return 0;
+
+  struct pending_line *pending = &lookahead[(lookahead_head + lookahead_count) % LOOKAHEADLINES];
+  int number = input_lines + 1;
+  struct timespec parse_start, parse_end;
+  clock_gettime(CLOCK_MONOTONIC, &parse_start);
+
+  // Read the line.
+  char *line = NULL;
+  size_t len = 0;
+  if (read_input_line(&line, &len, in_stream) == -1)
+  {
+    free(line);
+    if (!feof(in_stream))
+      lookahead_blocked = true; // Let the main loop report the error.
+    return 0;
+  }
+
+  for (int i = 0; i < MAXSEGNUM; i++)
+  {
+    pending->stdin_fds[i] = -1;
+  }
+  pending->loop_body = NULL;
+  pending->argc = parse_line_text(line, pending->array, in_stream, pending->stdin_fds, &pending->loop_body);
+
+  // Resolve and prefetch the executables, unless the line will be skipped.
+  if (pending->argc > 0 && number > resume_done_line)
+  {
+    prefetching = true;
+    validate_input_format(pending->argc, pending->array);
+    prefetching = false;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &parse_end);
+  pending->parse_usec = elapsed_usec(&parse_start, &parse_end);
+  pending->number = number;
+  lookahead_count++;
+  return 1;
+}
+
+/**
+ * Take the next line that was read ahead. Its arguments are moved into the array and its input documents become
+ * those of the current line.
+ *
+ * Input:
+ *    char *array[]: a fixed size (MAXLINELENGTH) array of character strings.
+ *    long *parse_usec: where the time spent parsing the line is stored.
+ *    int *number: where the number of the line in the input is stored.
+ *
+ * Output:
+ *    The number of arguments on the line, or -1 if there was an error.
+ */
+int next_lookahead_line(char *array[], long *parse_usec, int *number)
+{
+  struct pending_line *pending = &lookahead[lookahead_head];
+  lookahead_head = (lookahead_head + 1) % LOOKAHEADLINES;
+  lookahead_count--;
+
+  for (int i = 0; i < MAXSEGNUM; i++)
+  {
+    segment_stdin[i] = pending->stdin_fds[i];
+  }
+
+  loop_body = pending->loop_body;
+  for (int i = 0; i < pending->argc; i++)
+  {
+    array[i] = pending->array[i];
+  }
+  if (pending->argc >= 0)
+    array[pending->argc] = NULL;
+  *parse_usec = pending->parse_usec;
+  *number = pending->number;
+  return pending->argc;
+}
+
+/**
+ * Ask the kernel to start reading an executable into the page cache, so that it is ready when it is run.
+ *
+ * Input:
+ *    const char *fpath: the path of the executable.
+ */
+void prefetch_binary(const char *fpath)
+{
+  int fd = open(fpath, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return;
+  posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+  close(fd);
 }
 
 /**
  * This function should parse a command string, delimited by one or more strings length 1. 
  * It will keep all delimeter characters as command strings as well. It will update an 
- * index and add the parsed values to the command argument array provided.
+ * index and add the parsed values to the command argument array provided. A doubled '&'
+ * or '|' is kept together as a single '&&' or '||' string.
  *
  * Input:
  *    const char* input: Is a null terminated string.
@@ -265,20 +924,18 @@ int parse_input_line(char *array[], FILE *stream)
 int sub_parse(const char *input, char *del[], char *array[], int *index)
 {
   const char *token = input;
-  char *delimiter = NULL;
 
-  // Create the delim array.
-  int min_ind = strlen(input);
   while (*token != '\0')
   {
     // Get the next delimiter.
+    char *delimiter = NULL;
+    size_t min_ind = strlen(token);
     for (int i = 0; del[i] != NULL; i++)
     {
       const char *s = strstr(token, del[i]);
-      size_t len = s - token;
-      if (len < min_ind)
+      if (s != NULL && (size_t)(s - token) < min_ind)
       {
-        min_ind = len;
+        min_ind = s - token;
         delimiter = del[i];
       }
     }
@@ -311,10 +968,21 @@ int sub_parse(const char *input, char *del[], char *array[], int *index)
       array[(*index)++] = strndup(token, length);
     }
 
-    // Add the delimiter as a string.
-    array[(*index)++] = strdup(delimiter);
+    // check that we have a valid number of arguments.
+    if (*index + 1 >= MAXARGNUM)
+      return 0; // Failure.
 
-    token = end + 1;
+    // Add the delimiter as a string, keeping '&&' and '||' together.
+    if ((delimiter[0] == '&' || delimiter[0] == '|') && end[1] == delimiter[0])
+    {
+      array[(*index)++] = strndup(end, 2);
+      token = end + 2;
+    }
+    else
+    {
+      array[(*index)++] = strdup(delimiter);
+      token = end + 1;
+    }
   }
 
   // Return success.
@@ -322,52 +990,562 @@ int sub_parse(const char *input, char *del[], char *array[], int *index)
 }
 
 /**
- * This prints the error message for the program.
+ * This function expands the arguments of a group in a single pass. '$?' and the variables of the running loops are
+ * replaced by their values, which always stay in one argument. A word with a substitution is replaced by its
+ * output, which is split into arguments at whitespace only. Nothing that an expansion produces is expanded again
+ * or read as an operator, a redirect or another substitution, so the words it produces are recorded in
+ * expanded_words until the caller is done with them.
+ *
+ * Input:
+ *    int argc: the number of arguments.
+ *    char *argv[]: the arguments.
+ *    char *expanded[]: where the alloced arguments are stored, ending with NULL.
+ *    int max: the size of the expanded array.
+ *
+ * Output:
+ *    The number of expanded arguments, or -1 if a substitution failed or there were too many arguments.
  */
-void print_error_message()
+int expand_arguments(int argc, char *argv[], char *expanded[], int max)
 {
-  // Print error message.
-  char error_message[30] = "An error has occurred\n";
-  write(STDERR_FILENO, error_message, strlen(error_message));
-}
+  int count = 0;
+  int first_word = expanded_word_count;
+  bool failed = false;
 
-/**
- * This prints the query message for the program.
- */
-void print_query_message()
-{
-  // Print query message.
-  if (mode == INTERACTIVEMODE)
-    printf("\"%s\" - %s", cwd, QUERYSTR);
+  for (int i = 0; i < argc && !failed; i++)
+  {
+    if (strstr(argv[i], "$(") == NULL)
+    {
+      // Replace the variables, keeping the word whole.
+      if (count + 1 >= max || expanded_word_count == MAXEXPANDEDWORDS)
+      {
+        failed = true;
+        continue;
+      }
+      expanded[count] = expand_variables(argv[i]);
+      if (strcmp(expanded[count], argv[i]) != 0)
+        expanded_words[expanded_word_count++] = expanded[count];
+      count++;
+      continue;
+    }
+
+    // Split the output at whitespace.
+    char *output = expand_substitutions(argv[i]);
+    if (output == NULL)
+    {
+      failed = true;
+      continue;
+    }
+    char *in_Ptr = output;
+    char *o_Ptr;
+    while ((o_Ptr = strsep(&in_Ptr, " \r\n\t")) != NULL && !failed)
+    {
+      if (strcmp(o_Ptr, "") == 0)
+        continue;
+      if (count + 1 >= max || expanded_word_count == MAXEXPANDEDWORDS)
+        failed = true;
+      else
+      {
+        expanded[count] = strdup(o_Ptr);
+        expanded_words[expanded_word_count++] = expanded[count++];
+      }
+    }
+    free(output);
+  }
+
+  if (failed)
+  {
+    expanded_word_count = first_word;
+    free_arguments(count, expanded);
+    return -1;
+  }
+  expanded[count] = NULL;
+  return count;
 }
 
 /**
- * This sets the current working diretory variable.
+ * Check whether an argument is the given operator. Words that came from an expansion are never operators.
+ *
+ * Input:
+ *    const char *arg: the argument to check.
+ *    const char *op: the operator, such as '&' or '>'.
  *
  * Output:
- *    0 - if there was an error.
- *    1 - if the current working directory was set.
+ *    true - If the argument is the operator.
+ *    false - Otherwise.
  */
-int get_current_working_directory()
+bool is_operator(const char *arg, const char *op)
 {
-  // Set the current working directory.
-  if (getcwd(cwd, sizeof(cwd)) != NULL)
-  {
-    // printf("Current working dir: \"%s\"\n", cwd); // Comment out in final program.
-  }
-  else
+  if (arg == NULL || strcmp(arg, op) != 0)
+    return false;
+  for (int i = expanded_word_count - 1; i >= 0; i--)
   {
-    // There is an error retrieving the current working directory.
-    print_error_message();
-    return 0;
+    if (expanded_words[i] == arg)
+      return false;
   }
-  return 1;
+  return true;
 }
 
 /**
- * This will query the user for input string. The number of arguments given in the input string is returned.
- * If there is an error reading the input string, then -1 is returned. The arguments are stored int the array
- * parameter provided to the function.
+ * This function replaces every command substitution '$(cmd args)' in a word with the output of the command.
+ * Trailing newlines are removed from the output. Variables in the rest of the word are replaced as well.
+ *
+ * Input:
+ *    const char *input: the null terminated word to expand.
+ *
+ * Output:
+ *    The expanded word, which is alloced and should be freed after it is not needed, or NULL if a substitution
+ *    is not closed or its command fails.
+ */
+char *expand_substitutions(const char *input)
+{
+  char *result = NULL;
+  size_t size = 0;
+  FILE *out = open_memstream(&result, &size);
+  if (out == NULL)
+    return NULL;
+
+  const char *start;
+  while ((start = strstr(input, "$(")) != NULL)
+  {
+    write_expanded_variables(out, input, start - input);
+
+    // Find the matching parenthesis.
+    const char *end = start + 2;
+    int depth = 1;
+    while (*end != '\0' && depth > 0)
+    {
+      if (*end == '(')
+        depth++;
+      else if (*end == ')')
+        depth--;
+      end++;
+    }
+    if (depth > 0)
+    {
+      fclose(out);
+      free(result);
+      return NULL;
+    }
+
+    // Run the inner command, which expands its own substitutions.
+    char *inner = strndup(start + 2, end - start - 3);
+    char *output = run_substitution(inner);
+    free(inner);
+    if (output == NULL)
+    {
+      fclose(out);
+      free(result);
+      return NULL;
+    }
+
+    size_t len = strlen(output);
+    while (len > 0 && output[len - 1] == '\n')
+      len--;
+    fwrite(output, 1, len, out);
+    free(output);
+
+    input = end;
+  }
+
+  write_expanded_variables(out, input, strlen(input));
+  fclose(out);
+  return result;
+}
+
+/**
+ * This function runs a single command for a command substitution and captures its standard output. The arguments
+ * of the command are expanded first, so substitutions can be nested. The output is read from a pipe into a buffer
+ * that doubles as it fills, up to SUBSTMAXSIZE bytes.
+ *
+ * Input:
+ *    const char *cmd: the command and its arguments, delimited by whitespace.
+ *
+ * Output:
+ *    The output of the command, which is alloced and should be freed after it is not needed, or NULL if the
+ *    command could not be run or its output was too large.
+ */
+char *run_substitution(const char *cmd)
+{
+  // Split the command into arguments.
+  char *copy = strdup(cmd);
+  char *words[MAXARGNUM];
+  char *argv[MAXARGNUM];
+  int first_word = expanded_word_count;
+  int count = split_words(copy, words, MAXARGNUM - 1);
+  int argc = (count == -1) ? -1 : expand_arguments(count, words, argv, MAXARGNUM);
+  free(copy);
+  if (argc == -1)
+    return NULL;
+
+  char *fpath = (argc > 0) ? validate_path(argv[0]) : NULL;
+  int fds[2];
+  if (fpath == NULL || pipe2(fds, O_CLOEXEC) == -1)
+  {
+    free(fpath);
+    expanded_word_count = first_word;
+    free_arguments(argc, argv);
+    return NULL;
+  }
+
+  pid_t rc;
+  if ((rc = fork()) < 0)
+  {
+    close(fds[0]);
+    close(fds[1]);
+    free(fpath);
+    expanded_word_count = first_word;
+    free_arguments(argc, argv);
+    return NULL;
+  }
+  else if (rc == 0)
+  {
+    // Write the output to the pipe.
+    if (dup2(fds[1], STDOUT_FILENO) == -1)
+      _exit(1);
+    execv(fpath, argv);
+    _exit(1);
+  }
+  close(fds[1]);
+  free(fpath);
+  expanded_word_count = first_word;
+  free_arguments(argc, argv);
+
+  // Read the output, growing the buffer as needed.
+  size_t capacity = 4096;
+  size_t len = 0;
+  char *buffer = malloc(capacity);
+  ssize_t nread;
+  while (buffer != NULL)
+  {
+    if (len + 1 == capacity)
+    {
+      char *grown = (capacity < SUBSTMAXSIZE + 1) ? realloc(buffer, capacity * 2) : NULL;
+      if (grown == NULL)
+      {
+        // The output is too large.
+        free(buffer);
+        buffer = NULL;
+        kill(rc, SIGKILL);
+        break;
+      }
+      buffer = grown;
+      capacity *= 2;
+    }
+
+    nread = read(fds[0], &buffer[len], capacity - len - 1);
+    if (nread == -1 && errno == EINTR)
+      continue;
+    if (nread <= 0)
+      break;
+    len += nread;
+  }
+  close(fds[0]);
+  waitpid(rc, NULL, 0);
+
+  if (buffer != NULL && len > SUBSTMAXSIZE)
+  {
+    free(buffer);
+    return NULL;
+  }
+  if (buffer != NULL)
+    buffer[len] = '\0';
+  return buffer;
+}
+
+/**
+ * This function stores data in an anonymous memory file and seals it, so that it can be given to children as
+ * their standard input without touching the filesystem and without any of them being able to change it.
+ *
+ * Input:
+ *    const char *data: the data to store.
+ *    size_t len: the length of the data.
+ *
+ * Output:
+ *    A read-only descriptor for the memory file, or -1 if there was an error.
+ */
+int create_sealed_memfd(const char *data, size_t len)
+{
+  int fd = memfd_create("lsh-input", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd == -1)
+    return -1;
+
+  size_t written = 0;
+  while (written < len)
+  {
+    ssize_t nwrite = write(fd, &data[written], len - written);
+    if (nwrite == -1 && errno == EINTR)
+      continue;
+    if (nwrite <= 0)
+    {
+      close(fd);
+      return -1;
+    }
+    written += nwrite;
+  }
+
+  if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1)
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * This function reads the body of a here-document from the input stream, up to a line that only holds the
+ * delimiter, and stores it in a sealed memory file. The body is used as written.
+ *
+ * Input:
+ *    const char *delimiter: the line that ends the document.
+ *    FILE *stream: the stream to read the document from.
+ *
+ * Output:
+ *    A descriptor for the document, or -1 if there was an error.
+ */
+int read_here_document(const char *delimiter, FILE *stream)
+{
+  char *body = NULL;
+  size_t size = 0;
+  FILE *out = open_memstream(&body, &size);
+  if (out == NULL)
+    return -1;
+
+  char *line = NULL;
+  size_t len = 0;
+  ssize_t nread;
+  while ((nread = read_input_line(&line, &len, stream)) != -1)
+  {
+    // Check for the delimiter, ignoring the line ending.
+    size_t end = nread;
+    while (end > 0 && (line[end - 1] == '\n' || line[end - 1] == '\r'))
+      end--;
+    if (end == strlen(delimiter) && strncmp(line, delimiter, end) == 0)
+      break;
+
+    fwrite(line, 1, nread, out);
+  }
+  free(line);
+  fclose(out);
+
+  int fd = create_sealed_memfd(body, size);
+  free(body);
+  return fd;
+}
+
+/**
+ * This function takes any here-documents ('<< DELIMITER') and here-strings ('<<< WORD') out of the arguments of
+ * a line, and stores each one as the standard input of its segment. Each segment can have one of them.
+ *
+ * Input:
+ *    int argc: the number of arguments on the line.
+ *    char *array[]: the arguments on the line.
+ *    FILE *stream: the stream to read here-documents from.
+ *    int stdin_fds[]: where the document of each segment is stored.
+ *
+ * Output:
+ *    The number of arguments left on the line, or -1 if there was an error.
+ */
+int collect_input_documents(int argc, char *array[], FILE *stream, int stdin_fds[])
+{
+  int seg = 0;
+  bool nonempty = false;
+  int i = 0;
+
+  while (i < argc)
+  {
+    bool here_string = (strcmp(array[i], "<<<") == 0);
+    if (strcmp(array[i], "&") == 0 || is_list_operator(array[i]))
+    {
+      // Segments are counted the same way as when they are run.
+      if (nonempty)
+        seg++;
+      nonempty = false;
+      i++;
+      continue;
+    }
+    else if (!here_string && strcmp(array[i], "<<") != 0)
+    {
+      nonempty = true;
+      i++;
+      continue;
+    }
+
+    // Create the document.
+    int fd = -1;
+    if (i + 1 < argc && strcmp(array[i + 1], "&") != 0 && strcmp(array[i + 1], ">") != 0 &&
+        !is_list_operator(array[i + 1]) && seg < MAXSEGNUM &&
+        stdin_fds[seg] == -1)
+    {
+      if (here_string)
+      {
+        char *word = malloc(strlen(array[i + 1]) + 2);
+        sprintf(word, "%s\n", array[i + 1]);
+        fd = create_sealed_memfd(word, strlen(word));
+        free(word);
+      }
+      else if (stream != NULL)
+      {
+        fd = read_here_document(array[i + 1], stream);
+      }
+    }
+
+    if (fd == -1)
+    {
+      for (int j = 0; j < argc; j++)
+      {
+        free(array[j]);
+      }
+      return -1;
+    }
+    stdin_fds[seg] = fd;
+
+    // Remove the operator and its operand.
+    free(array[i]);
+    free(array[i + 1]);
+    memmove(&array[i], &array[i + 2], sizeof(char *) * (argc - i - 2));
+    argc -= 2;
+  }
+
+  array[argc] = NULL;
+  return argc;
+}
+
+/**
+ * Close the input documents of the current line once it has run.
+ */
+void close_input_documents()
+{
+  for (int i = 0; i < MAXSEGNUM; i++)
+  {
+    if (segment_stdin[i] != -1)
+    {
+      close(segment_stdin[i]);
+      segment_stdin[i] = -1;
+    }
+  }
+}
+
+/**
+ * This function reads the body of a 'while' loop from the input stream, up to the 'done' that closes it. Loops
+ * inside the body are kept in it, along with their own 'done' lines.
+ *
+ * Input:
+ *    FILE *stream: the stream to read the body from.
+ *
+ * Output:
+ *    The alloced text of the body, or NULL if the stream ended before the loop was closed.
+ */
+char *read_loop_body(FILE *stream)
+{
+  char *body = NULL;
+  size_t size = 0;
+  FILE *out = open_memstream(&body, &size);
+  if (out == NULL)
+    return NULL;
+
+  char *line = NULL;
+  size_t len = 0;
+  ssize_t nread;
+  int depth = 0;
+  bool closed = false;
+  while ((nread = read_input_line(&line, &len, stream)) != -1)
+  {
+    depth += loop_nesting(line, nread);
+    if (depth < 0)
+    {
+      closed = true;
+      break;
+    }
+    fwrite(line, 1, nread, out);
+  }
+  free(line);
+  fclose(out);
+
+  if (!closed)
+  {
+    free(body);
+    return NULL;
+  }
+  return body;
+}
+
+/**
+ * Find how a line changes the nesting of loops. A line that starts with 'while' opens a loop, and a line that only
+ * holds 'done' closes one.
+ *
+ * Input:
+ *    const char *line: the text of the line.
+ *    size_t len: the length of the line.
+ *
+ * Output:
+ *    1 - If the line opens a loop.
+ *   -1 - If the line closes a loop.
+ *    0 - Otherwise.
+ */
+int loop_nesting(const char *line, size_t len)
+{
+  while (len > 0 && isspace((unsigned char)*line))
+  {
+    line++;
+    len--;
+  }
+  while (len > 0 && isspace((unsigned char)line[len - 1]))
+    len--;
+
+  if (len >= 5 && strncmp(line, "while", 5) == 0 && (len == 5 || isspace((unsigned char)line[5])))
+    return 1;
+  if (len == 4 && strncmp(line, "done", 4) == 0)
+    return -1;
+  return 0;
+}
+
+/**
+ * This prints the error message for the program.
+ */
+void print_error_message()
+{
+  // Print error message.
+  char error_message[30] = "An error has occurred\n";
+  write(STDERR_FILENO, error_message, strlen(error_message));
+}
+
+/**
+ * This prints the query message for the program.
+ */
+void print_query_message()
+{
+  // Print query message.
+  if (mode == INTERACTIVEMODE)
+    printf("\"%s\" - %s", cwd, QUERYSTR);
+}
+
+/**
+ * This sets the current working diretory variable.
+ *
+ * Output:
+ *    0 - if there was an error.
+ *    1 - if the current working directory was set.
+ */
+int get_current_working_directory()
+{
+  // Set the current working directory.
+  if (getcwd(cwd, sizeof(cwd)) != NULL)
+  {
+    // printf("Current working dir: \"%s\"\n", cwd); // Comment out in final program.
+  }
+  else
+  {
+    // There is an error retrieving the current working directory.
+    print_error_message();
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * This will query the user for input string. The number of arguments given in the input string is returned.
+ * If there is an error reading the input string, then -1 is returned. The arguments are stored int the array
+ * parameter provided to the function.
  *
  * Input:
  *    char *array[]: a fixed size (MAXLINELENGTH) array of character strings.
@@ -406,9 +1584,24 @@ int get_user_input(char *array[], FILE *stream)
  *    an integer value
  *      If there is a valid executable within the path variables, return the relative path the executable.
  *      If the argument is not an executable command in the path locations, return NULL.
+ *
+ * Executables that are found are cached until the paths or the working directory change, so a command is only
+ * searched for once. While reading ahead, the executable is also prefetched into the page cache.
  */
 char *validate_path(char *cmd)
 {
+  // Check the cache first.
+  size_t slot = 0;
+  for (const char *c = cmd; *c != '\0'; c++)
+  {
+    slot = slot * 31 + (unsigned char)*c;
+  }
+  struct path_cache_entry *cached = &path_cache[slot % PATHCACHESIZE];
+  if (cached->cmd != NULL && cached->generation == path_generation && strcmp(cached->cmd, cmd) == 0)
+  {
+    return strdup(cached->fpath);
+  }
+
   // For each path.
   for (int path_number = 0; path_number < program_path_count; path_number++)
   {
@@ -438,6 +1631,15 @@ char *validate_path(char *cmd)
     fd = access(temp_cmd, X_OK);
     if (fd != -1) // There was no error accessing the executable.
     {
+      // Remember where the command was found.
+      free(cached->cmd);
+      free(cached->fpath);
+      cached->cmd = strdup(cmd);
+      cached->fpath = strdup(temp_cmd);
+      cached->generation = path_generation;
+      if (prefetching)
+        prefetch_binary(temp_cmd);
+
       // If the command string is valid, return it.
       return temp_cmd;
     }
@@ -454,7 +1656,7 @@ char *validate_path(char *cmd)
 
 /**
  * This function checks whether the exit command is called and valid. If the exit command is valid, this function exits the program completely.
- * A valid call will only have one argument.
+ * A valid call will have no arguments, or a single status from 0 to 255 to exit with.
  *
  * Input:
  *    int argc: The count of argumemts passed to the program by the input string.
@@ -470,12 +1672,16 @@ int register_exit_command(int argc, char *argv[])
   // If a valid 'exit' command has been called.
   if (strcmp(argv[0], "exit") == 0)
   {
-    if (argc == 1)
+    char *end = NULL;
+    long status = (argc == 2) ? strtol(argv[1], &end, 10) : 0;
+    if (argc == 1 || (argc == 2 && *end == '\0' && end != argv[1] && status >= 0 && status <= 255))
     {
       // Clear all alloced memory.
       clean_memory(argc, argv);
+      write_profile();
+      close_journal();
       close_input();
-      exit(0);
+      exit((int)status);
     }
     else
       return -1;
@@ -578,334 +1784,3109 @@ int register_path_command(int argc, char *argv[])
 }
 
 /**
- * This function takes the input arguments and checks if they are in a valid form of the built-in commands. If so, and they are in a
- * valid argument structure, the program will execute the command. The function will not mutate any variables given to it.
+ * This function checks whether the timeout command is called as a built-in. The arguments are valid if the first
+ * argument is timeout and the second is a duration. A valid call will only have two arguments, and sets the default
+ * deadline applied to every command segment that does not give its own. A duration of 0 removes the default.
+ * When timeout is followed by a command, it is a prefix for that command and is handled by the executor instead.
  *
  * Input:
- *    int argc: The count of argumemts passed to the program by the input string. This will be -1, if an error has occured previously.
+ *    int argc: The count of argumemts passed to the program by the input string.
  *    char *array[]: a fixed size (MAXLINELENGTH) array of character strings which hold the input arguments.
  *
  * Output:
  *    An integer value -
  *      0 - if the argument passed to the function was not of the built-in arguments.
- *      1 - if the arguments passed to the function did follow the built-in argument structure and the function was executed properly.
- *     -1 - if an error has occured.
+ *      1 - if the argument passed to the funtion was valid.
+ *     -1 - if an error has occured, such as an invalid number of arguments.
  */
-int register_built_in_commands(int argc, char *argv[])
+int register_timeout_command(int argc, char *argv[])
 {
-  if (argc == -1)
-    return argc; // If an error occured previously.
-
-  int cmdVal; // Store the value that is returned by the checks.
-
-  // If a valid 'exit' command has been called.
-  cmdVal = register_exit_command(argc, argv);
-  if (cmdVal != 0)
+  // If a valid 'timeout' command has been called.
+  if (strcmp(argv[0], "timeout") == 0) // The 'timeout' command was called.
   {
-    return cmdVal;
-  }
+    if (argc == 2) // Only a duration was given, so set the default.
+    {
+      long ms = parse_duration(argv[1]);
+      if (ms < 0)
+        return -1;
 
-  // If a valid 'cd' command has been called.
-  cmdVal = register_cd_command(argc, argv);
-  if (cmdVal != 0)
-  {
-    get_current_working_directory(); // Reset the current working directory.
-    return cmdVal;
+      default_timeout_ms = ms;
+      return 1;
+    }
+    else if (argc == 1)
+      return -1;
   }
-
+  return 0; // Nothing happens.
+}
+
+/**
+ * This function checks whether the hedge command is called and valid. The arguments are valid if the first argument
+ * is hedge and the second is a percentile between 0 and 100. Once set, any segment of a parallel group that is still
+ * running after that percentile of its siblings have finished is launched a second time, and whichever copy finishes
+ * first wins. Segments with an output redirect are never hedged. A percentile of 0 turns hedging off.
+ *
+ * Input:
+ *    int argc: The count of argumemts passed to the program by the input string.
+ *    char *array[]: a fixed size (MAXLINELENGTH) array of character strings which hold the input arguments.
+ *
+ * Output:
+ *    An integer value -
+ *      0 - if the argument passed to the function was not of the built-in arguments.
+ *      1 - if the argument passed to the funtion was valid.
+ *     -1 - if an error has occured, such as an invalid number of arguments.
+ */
+int register_hedge_command(int argc, char *argv[])
+{
+  // If a valid 'hedge' command has been called.
+  if (strcmp(argv[0], "hedge") == 0) // The 'hedge' command was called.
+  {
+    if (argc == 2) // The proper number of arguments were used.
+    {
+      char *end;
+      long percentile = strtol(argv[1], &end, 10);
+      if (*end != '\0' || end == argv[1] || percentile < 0 || percentile > 100)
+        return -1;
+
+      hedge_percentile = (int)percentile;
+      return 1;
+    }
+    else
+      return -1;
+  }
+  return 0; // Nothing happens.
+}
+
+/**
+ * This function checks whether the concurrency command is called and valid. With no arguments, it prints the state
+ * of the concurrency controller. 'concurrency auto' lets the controller pick the limit from the pressure on the
+ * host, starting at the number of CPUs. 'concurrency N' fixes the limit at N and 'concurrency off' removes it.
+ *
+ * Input:
+ *    int argc: The count of argumemts passed to the program by the input string.
+ *    char *array[]: a fixed size (MAXLINELENGTH) array of character strings which hold the input arguments.
+ *
+ * Output:
+ *    An integer value -
+ *      0 - if the argument passed to the function was not of the built-in arguments.
+ *      1 - if the argument passed to the funtion was valid.
+ *     -1 - if an error has occured, such as an invalid number of arguments.
+ */
+int register_concurrency_command(int argc, char *argv[])
+{
+  // If a valid 'concurrency' command has been called.
+  if (strcmp(argv[0], "concurrency") == 0) // The 'concurrency' command was called.
+  {
+    if (argc == 1) // Show the state of the controller.
+    {
+      const char *modes[] = {"off", "fixed", "auto"};
+      printf("concurrency: mode=%s limit=%d\n", modes[concurrency.mode], concurrency.limit);
+      printf("pressure: cpu=%.2f memory=%.2f io=%.2f load=%.2f cpus=%d\n", concurrency.cpu, concurrency.memory,
+             concurrency.io, concurrency.load, concurrency.cpus);
+      printf("decisions: last=%s increases=%ld decreases=%ld\n", concurrency.decision, concurrency.increases,
+             concurrency.decreases);
+      fflush(stdout);
+      return 1;
+    }
+    else if (argc == 2)
+    {
+      char *end;
+      long limit = strtol(argv[1], &end, 10);
+
+      if (strcmp(argv[1], "off") == 0)
+      {
+        concurrency.mode = CONCURRENCYOFF;
+        concurrency.limit = MAXSEGNUM;
+      }
+      else if (strcmp(argv[1], "auto") == 0)
+      {
+        concurrency.mode = CONCURRENCYAUTO;
+        concurrency.limit = (concurrency.cpus < MAXSEGNUM) ? concurrency.cpus : MAXSEGNUM;
+        concurrency.sampled = false;
+        concurrency.decreased = false;
+      }
+      else if (*end == '\0' && end != argv[1] && limit >= 1 && limit <= MAXSEGNUM)
+      {
+        concurrency.mode = CONCURRENCYFIXED;
+        concurrency.limit = (int)limit;
+      }
+      else
+        return -1;
+      return 1;
+    }
+    else
+      return -1;
+  }
+  return 0; // Nothing happens.
+}
+
+/**
+ * This function checks whether the set command is called and valid. 'set -e' turns on fail-fast mode: as soon as a
+ * command fails, the other commands running beside it are cancelled and the shell exits with its status. Failures
+ * on the left of '&&' or '||' do not count. 'set +e' turns fail-fast mode off.
+ *
+ * Input:
+ *    int argc: The count of argumemts passed to the program by the input string.
+ *    char *array[]: a fixed size (MAXLINELENGTH) array of character strings which hold the input arguments.
+ *
+ * Output:
+ *    An integer value -
+ *      0 - if the argument passed to the function was not of the built-in arguments.
+ *      1 - if the argument passed to the funtion was valid.
+ *     -1 - if an error has occured, such as an invalid number of arguments.
+ */
+int register_set_command(int argc, char *argv[])
+{
+  // If a valid 'set' command has been called.
+  if (strcmp(argv[0], "set") == 0) // The 'set' command was called.
+  {
+    if (argc == 2 && strcmp(argv[1], "-e") == 0)
+    {
+      fail_fast = true;
+      return 1;
+    }
+    else if (argc == 2 && strcmp(argv[1], "+e") == 0)
+    {
+      fail_fast = false;
+      return 1;
+    }
+    else
+      return -1;
+  }
+  return 0; // Nothing happens.
+}
+
+/**
+ * This function checks whether a 'while read' loop is called and valid. 'while read VAR... < FILE' runs the body
+ * of the loop, the lines up to its 'done', once for every line of FILE. Each line is split at spaces and tabs into
+ * the variables, the last of which gets the rest of the line, and '$VAR' in the body is replaced by its value. The
+ * shell reads FILE itself, so only the commands in the body that are not built in are forked.
+ *
+ * Input:
+ *    int argc: The count of argumemts passed to the program by the input string.
+ *    char *array[]: a fixed size (MAXLINELENGTH) array of character strings which hold the input arguments.
+ *
+ * Output:
+ *    An integer value -
+ *      0 - if the argument passed to the function was not of the built-in arguments.
+ *      1 - if the argument passed to the funtion was valid.
+ *     -1 - if an error has occured, such as an invalid number of arguments.
+ */
+int register_while_command(int argc, char *argv[])
+{
+  // If a valid 'while' command has been called.
+  if (strcmp(argv[0], "while") == 0) // The 'while' command was called.
+  {
+    int vars = argc - 4;
+    if (argc < 5 || strcmp(argv[1], "read") != 0 || !is_operator(argv[argc - 2], "<") || loop_body == NULL ||
+        loop_variable_count + vars > MAXLOOPVARS)
+      return -1;
+
+    // Check the names of the variables.
+    for (int i = 2; i < argc - 2; i++)
+    {
+      if (!isalpha((unsigned char)argv[i][0]) && argv[i][0] != '_')
+        return -1;
+      for (const char *c = argv[i]; *c != '\0'; c++)
+      {
+        if (!isalnum((unsigned char)*c) && *c != '_')
+          return -1;
+      }
+    }
+
+    struct line_scanner sc;
+    if (open_line_scanner(&sc, argv[argc - 1]) == -1)
+      return -1;
+
+    // The body of a nested loop replaces this one while it runs.
+    const char *body = loop_body;
+    int first = loop_variable_count;
+    for (int i = 0; i < vars; i++)
+    {
+      loop_variables[first + i].name = argv[2 + i];
+    }
+    loop_variable_count += vars;
+    loop_depth++;
+
+    // Run the body for every line, ending each line in place.
+    bool ran = false;
+    char *block;
+    size_t len;
+    int rc;
+    while ((rc = next_line_block(&sc, &block, &len)) == 1)
+    {
+      char *end = block + len;
+      while (block < end)
+      {
+        char *line_end = memchr(block, '\n', end - block);
+        if (line_end == NULL)
+          line_end = end;
+        *line_end = '\0';
+
+        split_loop_line(block, first, vars);
+        run_loop_body(body);
+        ran = true;
+        block = line_end + 1;
+      }
+    }
+
+    loop_depth--;
+    loop_variable_count = first;
+    close_line_scanner(&sc);
+
+    // The loop has the status of the last command in its body.
+    builtin_status = ran ? last_status : 0;
+    return (rc == -1) ? -1 : 1;
+  }
+  return 0; // Nothing happens.
+}
+
+/**
+ * This function checks whether the count command is called and valid. 'count FILE' prints the number of lines in
+ * FILE, and 'count TEXT FILE' prints the number of lines that contain TEXT. The output can be redirected.
+ *
+ * Input:
+ *    int argc: The count of argumemts passed to the program by the input string.
+ *    char *array[]: a fixed size (MAXLINELENGTH) array of character strings which hold the input arguments.
+ *
+ * Output:
+ *    An integer value -
+ *      0 - if the argument passed to the function was not of the built-in arguments.
+ *      1 - if the argument passed to the funtion was valid.
+ *     -1 - if an error has occured, such as an invalid number of arguments.
+ */
+int register_count_command(int argc, char *argv[])
+{
+  // If a valid 'count' command has been called.
+  if (strcmp(argv[0], "count") == 0) // The 'count' command was called.
+  {
+    struct line_scanner sc;
+    int redirect_argc = argc;
+    if (validate_io_redirect_format(argc, argv) == 1)
+      redirect_argc -= 2;
+    if ((redirect_argc != 2 && redirect_argc != 3) || open_line_scanner(&sc, argv[redirect_argc - 1]) == -1)
+      return -1;
+
+    FILE *out = open_builtin_output(&argc, argv);
+    if (out == NULL)
+    {
+      close_line_scanner(&sc);
+      return -1;
+    }
+
+    const char *text = (argc == 3) ? argv[1] : NULL;
+    size_t text_len = (text != NULL) ? strlen(text) : 0;
+    long lines = 0;
+    char *block;
+    size_t len;
+    int rc;
+    while ((rc = next_line_block(&sc, &block, &len)) == 1)
+    {
+      if (text == NULL)
+      {
+        // Count the newlines, and a last line without one.
+        lines += count_byte(block, len, '\n') + (block[len - 1] != '\n');
+        continue;
+      }
+
+      // Jump from match to match, counting each line once.
+      char *end = block + len;
+      char *found;
+      while (block < end && (found = memmem(block, end - block, text, text_len)) != NULL)
+      {
+        lines++;
+        char *line_end = memchr(found, '\n', end - found);
+        block = (line_end != NULL) ? line_end + 1 : end;
+      }
+    }
+    close_line_scanner(&sc);
+
+    if (rc == 0)
+      fprintf(out, "%ld\n", lines);
+    close_builtin_output(out);
+    return (rc == -1) ? -1 : 1;
+  }
+  return 0; // Nothing happens.
+}
+
+/**
+ * This function checks whether the match command is called and valid. 'match TEXT FILE' prints the lines of FILE
+ * that contain TEXT, and 'match -v TEXT FILE' prints the lines that do not. The output can be redirected. The
+ * status is 1 if no line was printed.
+ *
+ * Input:
+ *    int argc: The count of argumemts passed to the program by the input string.
+ *    char *array[]: a fixed size (MAXLINELENGTH) array of character strings which hold the input arguments.
+ *
+ * Output:
+ *    An integer value -
+ *      0 - if the argument passed to the function was not of the built-in arguments.
+ *      1 - if the argument passed to the funtion was valid.
+ *     -1 - if an error has occured, such as an invalid number of arguments.
+ */
+int register_match_command(int argc, char *argv[])
+{
+  // If a valid 'match' command has been called.
+  if (strcmp(argv[0], "match") == 0) // The 'match' command was called.
+  {
+    struct line_scanner sc;
+    int redirect_argc = argc;
+    if (validate_io_redirect_format(argc, argv) == 1)
+      redirect_argc -= 2;
+    bool invert = (redirect_argc == 4 && strcmp(argv[1], "-v") == 0);
+    if ((redirect_argc != 3 && !invert) || open_line_scanner(&sc, argv[redirect_argc - 1]) == -1)
+      return -1;
+
+    FILE *out = open_builtin_output(&argc, argv);
+    if (out == NULL)
+    {
+      close_line_scanner(&sc);
+      return -1;
+    }
+
+    const char *text = argv[argc - 2];
+    size_t text_len = strlen(text);
+    long printed = 0;
+    char *block;
+    size_t len;
+    int rc;
+    while ((rc = next_line_block(&sc, &block, &len)) == 1)
+    {
+      char *end = block + len;
+      while (block < end)
+      {
+        char *line = block;
+        char *line_end;
+        if (invert)
+        {
+          // Check the lines one at a time.
+          line_end = memchr(line, '\n', end - line);
+          if (line_end == NULL)
+            line_end = end;
+          block = line_end + 1;
+          if (memmem(line, line_end - line, text, text_len) != NULL)
+            continue;
+        }
+        else
+        {
+          // Search the rest of the block, and print the line around the match.
+          char *found = memmem(block, end - block, text, text_len);
+          if (found == NULL)
+            break;
+          char *line_start = memrchr(block, '\n', found - block);
+          if (line_start != NULL)
+            line = line_start + 1;
+          line_end = memchr(found, '\n', end - found);
+          if (line_end == NULL)
+            line_end = end;
+          block = line_end + 1;
+        }
+
+        fwrite_unlocked(line, 1, line_end - line, out);
+        fputc_unlocked('\n', out);
+        printed++;
+      }
+    }
+    close_line_scanner(&sc);
+    close_builtin_output(out);
+
+    builtin_status = (printed > 0) ? 0 : 1;
+    return (rc == -1) ? -1 : 1;
+  }
+  return 0; // Nothing happens.
+}
+
+/**
+ * This function checks whether the fields command is called and valid. 'fields LIST FILE' prints chosen fields
+ * of every line of FILE, where LIST is a comma separated list of field numbers starting at 1, such as '3,1'.
+ * Fields are split at runs of spaces and tabs, or at every C with 'fields -d C LIST FILE', and are printed
+ * separated by a space or by C. The output can be redirected.
+ *
+ * Input:
+ *    int argc: The count of argumemts passed to the program by the input string.
+ *    char *array[]: a fixed size (MAXLINELENGTH) array of character strings which hold the input arguments.
+ *
+ * Output:
+ *    An integer value -
+ *      0 - if the argument passed to the function was not of the built-in arguments.
+ *      1 - if the argument passed to the funtion was valid.
+ *     -1 - if an error has occured, such as an invalid number of arguments.
+ */
+int register_fields_command(int argc, char *argv[])
+{
+  // If a valid 'fields' command has been called.
+  if (strcmp(argv[0], "fields") == 0) // The 'fields' command was called.
+  {
+    int redirect_argc = argc;
+    if (validate_io_redirect_format(argc, argv) == 1)
+      redirect_argc -= 2;
+
+    // Read the delimiter.
+    char delimiter = '\0';
+    if (redirect_argc == 5 && strcmp(argv[1], "-d") == 0 && strlen(argv[2]) == 1 && argv[2][0] != '\n')
+      delimiter = argv[2][0];
+    else if (redirect_argc != 3)
+      return -1;
+
+    // Read the list of fields.
+    int list[MAXARGNUM];
+    int list_count = 0;
+    int max_field = 0;
+    char *item = argv[redirect_argc - 2];
+    while (1)
+    {
+      char *end;
+      long field = strtol(item, &end, 10);
+      if (end == item || field < 1 || field > MAXARGNUM || list_count == MAXARGNUM || (*end != ',' && *end != '\0'))
+        return -1;
+      list[list_count++] = (int)field;
+      if (field > max_field)
+        max_field = (int)field;
+      if (*end == '\0')
+        break;
+      item = end + 1;
+    }
+
+    struct line_scanner sc;
+    if (open_line_scanner(&sc, argv[redirect_argc - 1]) == -1)
+      return -1;
+    FILE *out = open_builtin_output(&argc, argv);
+    if (out == NULL)
+    {
+      close_line_scanner(&sc);
+      return -1;
+    }
+
+    char *block;
+    size_t len;
+    int rc;
+    while ((rc = next_line_block(&sc, &block, &len)) == 1)
+    {
+      char *end = block + len;
+      while (block < end)
+      {
+        char *line_end = memchr(block, '\n', end - block);
+        if (line_end == NULL)
+          line_end = end;
+
+        // Split the line up to the last field that is printed.
+        char *starts[MAXARGNUM];
+        size_t lengths[MAXARGNUM];
+        int found = 0;
+        char *c = block;
+        while (found < max_field)
+        {
+          char *field_end;
+          if (delimiter == '\0')
+          {
+            while (c < line_end && (*c == ' ' || *c == '\t'))
+              c++;
+            if (c == line_end)
+              break;
+            field_end = c;
+            while (field_end < line_end && *field_end != ' ' && *field_end != '\t')
+              field_end++;
+          }
+          else
+          {
+            field_end = memchr(c, delimiter, line_end - c);
+            if (field_end == NULL)
+              field_end = line_end;
+          }
+
+          starts[found] = c;
+          lengths[found++] = field_end - c;
+          if (field_end == line_end)
+            break;
+          c = field_end + 1;
+        }
+
+        // Print the chosen fields, leaving out the ones the line does not have.
+        for (int i = 0; i < list_count; i++)
+        {
+          if (i > 0)
+            fputc_unlocked(delimiter == '\0' ? ' ' : delimiter, out);
+          if (list[i] <= found)
+            fwrite_unlocked(starts[list[i] - 1], 1, lengths[list[i] - 1], out);
+        }
+        fputc_unlocked('\n', out);
+        block = line_end + 1;
+      }
+    }
+    close_line_scanner(&sc);
+    close_builtin_output(out);
+    return (rc == -1) ? -1 : 1;
+  }
+  return 0; // Nothing happens.
+}
+
+/**
+ * This function takes the input arguments and checks if they are in a valid form of the built-in commands. If so, and they are in a
+ * valid argument structure, the program will execute the command. The function will not mutate any variables given to it.
+ *
+ * Input:
+ *    int argc: The count of argumemts passed to the program by the input string. This will be -1, if an error has occured previously.
+ *    char *array[]: a fixed size (MAXLINELENGTH) array of character strings which hold the input arguments.
+ *
+ * Output:
+ *    An integer value -
+ *      0 - if the argument passed to the function was not of the built-in arguments.
+ *      1 - if the arguments passed to the function did follow the built-in argument structure and the function was executed properly.
+ *     -1 - if an error has occured.
+ */
+int register_built_in_commands(int argc, char *argv[])
+{
+  if (argc == -1)
+    return argc; // If an error occured previously.
+
+  int cmdVal; // Store the value that is returned by the checks.
+
+  // If a valid 'exit' command has been called.
+  cmdVal = register_exit_command(argc, argv);
+  if (cmdVal != 0)
+  {
+    return cmdVal;
+  }
+
+  // If a valid 'cd' command has been called.
+  cmdVal = register_cd_command(argc, argv);
+  if (cmdVal != 0)
+  {
+    get_current_working_directory(); // Reset the current working directory.
+    path_generation++;               // Relative paths now resolve differently.
+    return cmdVal;
+  }
+
   // If a valid 'path' command has been called.
   cmdVal = register_path_command(argc, argv);
   if (cmdVal != 0)
   {
-    return cmdVal;
+    path_generation++; // Cached executables are no longer valid.
+    return cmdVal;
+  }
+
+  // If a valid 'timeout' command has been called.
+  cmdVal = register_timeout_command(argc, argv);
+  if (cmdVal != 0)
+  {
+    return cmdVal;
+  }
+
+  // If a valid 'hedge' command has been called.
+  cmdVal = register_hedge_command(argc, argv);
+  if (cmdVal != 0)
+  {
+    return cmdVal;
+  }
+
+  // If a valid 'concurrency' command has been called.
+  cmdVal = register_concurrency_command(argc, argv);
+  if (cmdVal != 0)
+  {
+    return cmdVal;
+  }
+
+  // If a valid 'set' command has been called.
+  cmdVal = register_set_command(argc, argv);
+  if (cmdVal != 0)
+  {
+    return cmdVal;
+  }
+
+  // If a valid 'while' loop has been called.
+  cmdVal = register_while_command(argc, argv);
+  if (cmdVal != 0)
+  {
+    return cmdVal;
+  }
+
+  // If a valid 'count' command has been called.
+  cmdVal = register_count_command(argc, argv);
+  if (cmdVal != 0)
+  {
+    return cmdVal;
+  }
+
+  // If a valid 'match' command has been called.
+  cmdVal = register_match_command(argc, argv);
+  if (cmdVal != 0)
+  {
+    return cmdVal;
+  }
+
+  // If a valid 'fields' command has been called.
+  cmdVal = register_fields_command(argc, argv);
+  if (cmdVal != 0)
+  {
+    return cmdVal;
+  }
+
+  // No valid command.
+  return 0;
+}
+
+/**
+ * Register the arguments given to this program and proceed to the appropriate task. A line is a list of command
+ * groups separated by ';', '&&' or '||'. A group after '&&' only runs if the last status was 0, and a group after
+ * '||' only runs if it was not. The status of each group that runs becomes the last status ('$?'). In fail-fast
+ * mode, a failing group that is not on the left of '&&' or '||' stops the shell.
+ *
+ * Input:
+ *    int argc: the number of arguments given to the command line.
+ *    char *argv[]: an array of the arguments passed to this program.
+ */
+void register_arguments(int argc, char *argv[])
+{
+  if (argc < 0)
+  {
+    // There was an error.
+    print_error_message();
+    last_status = 1;
+    return;
+  }
+  else if (argc == 0)
+  {
+    // There were no arguments passed.
+    return;
+  }
+  else if (validate_list_format(argc, argv) == -1)
+  {
+    // The operators are not used correctly.
+    print_error_message();
+    last_status = 1;
+    return;
+  }
+  else
+  {
+    int start = 0;
+    int first_index = 0;
+    const char *op_before = NULL;
+
+    for (int i = 0; i <= argc; i++)
+    {
+      if (i < argc && !is_list_operator(argv[i]))
+        continue;
+
+      // End the group at the operator.
+      const char *op_after = (i < argc) ? argv[i] : NULL;
+      argv[i] = NULL;
+      int count = i - start;
+
+      // Decide whether the group runs.
+      bool run = (count > 0);
+      if (op_before != NULL && strcmp(op_before, "&&") == 0 && last_status != 0)
+        run = false;
+      if (op_before != NULL && strcmp(op_before, "||") == 0 && last_status == 0)
+        run = false;
+
+      bool checked = fail_fast && (op_after == NULL || strcmp(op_after, ";") == 0);
+      if (run)
+      {
+        last_status = run_command_group(count, &argv[start], first_index, checked);
+
+        // Stop the run when a checked group fails.
+        if (checked && last_status != 0)
+        {
+          write_profile();
+          close_journal();
+          close_input();
+          exit(last_status);
+        }
+      }
+
+      first_index += count_segments(count, &argv[start]);
+      free((char *)op_before);
+      op_before = op_after;
+      start = i + 1;
+    }
+    free((char *)op_before);
+
+    return;
+  }
+}
+
+/**
+ * Check whether an argument is one of the operators that separate command groups.
+ *
+ * Input:
+ *    const char *token: the argument to check.
+ *
+ * Output:
+ *    true - If the argument is ';', '&&' or '||'.
+ *    false - Otherwise.
+ */
+bool is_list_operator(const char *token)
+{
+  return token != NULL && (strcmp(token, ";") == 0 || strcmp(token, "&&") == 0 || strcmp(token, "||") == 0);
+}
+
+/**
+ * This function checks that the operators on a line separate command groups correctly. Every '&&' and '||' must
+ * have a command on both sides, and every ';' must have a command before it. A single '|' is not supported.
+ *
+ * Input:
+ *    int argc: the number of arguments given to command line.
+ *    char *argv[]: an array of the arguments passed to this program.
+ *
+ * Output:
+ *    0 - If the operators are used correctly.
+ *   -1 - Otherwise.
+ */
+int validate_list_format(int argc, char *argv[])
+{
+  int commands = 0;
+  const char *op_before = NULL;
+
+  for (int i = 0; i < argc; i++)
+  {
+    if (strcmp(argv[i], "|") == 0)
+      return -1;
+
+    if (is_list_operator(argv[i]))
+    {
+      if (commands == 0)
+        return -1; // There is no command before the operator.
+      op_before = argv[i];
+      commands = 0;
+    }
+    else if (strcmp(argv[i], "&") != 0)
+    {
+      commands++;
+    }
+  }
+
+  // Only ';' may end a line.
+  if (commands == 0 && op_before != NULL && strcmp(op_before, ";") != 0)
+    return -1;
+  return 0;
+}
+
+/**
+ * Count the segments of a command group, the same way that they are counted when they are run.
+ *
+ * Input:
+ *    int argc: the number of arguments in the group.
+ *    char *argv[]: the arguments in the group.
+ *
+ * Output:
+ *    The number of non-empty segments delimited by '&'.
+ */
+int count_segments(int argc, char *argv[])
+{
+  int n = 0;
+  int current_cnt = 0;
+  for (int i = 0; i <= argc; i++)
+  {
+    if (i == argc || argv[i] == NULL || strcmp(argv[i], "&") == 0)
+    {
+      if (current_cnt > 0)
+        n++;
+      current_cnt = 0;
+    }
+    else
+    {
+      current_cnt++;
+    }
+  }
+  return n;
+}
+
+/**
+ * Run one command group, after expanding the variables and command substitutions in its arguments.
+ *
+ * Input:
+ *    int argc: the number of arguments in the group.
+ *    char *argv[]: the arguments in the group, ending with NULL.
+ *    int first_index: the index of the group's first segment within the line.
+ *    bool cancel_on_failure: whether a failing segment cancels the rest of the group.
+ *
+ * Output:
+ *    The exit status of the group.
+ */
+int run_command_group(int argc, char *argv[], int first_index, bool cancel_on_failure)
+{
+  // Expand the variables and run the command substitutions of the group.
+  char *expanded[MAXARGNUM];
+  int first_word = expanded_word_count;
+  int count = expand_arguments(argc, argv, expanded, MAXARGNUM);
+  if (count == -1)
+  {
+    print_error_message();
+    return 1;
+  }
+
+  int status = run_expanded_group(count, expanded, first_index, cancel_on_failure);
+  expanded_word_count = first_word;
+  free_arguments(count, expanded);
+  return status;
+}
+
+/**
+ * Run one expanded command group: either a built-in command, or programs delimited by '&' that run in parallel.
+ *
+ * Input:
+ *    int argc: the number of arguments in the group.
+ *    char *argv[]: the arguments in the group, ending with NULL.
+ *    int first_index: the index of the group's first segment within the line.
+ *    bool cancel_on_failure: whether a failing segment cancels the rest of the group.
+ *
+ * Output:
+ *    The exit status of the group.
+ */
+int run_expanded_group(int argc, char *argv[], int first_index, bool cancel_on_failure)
+{
+
+  // Try to check and register built in commands.
+  struct timespec phase_start, phase_end;
+  clock_gettime(CLOCK_MONOTONIC, &phase_start);
+  builtin_status = 0;
+  int result = register_built_in_commands(argc, argv);
+  if (result != 0)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &phase_end);
+    if (profile_path != NULL)
+      profile_record_phase(argv[0], PROFILERUN, elapsed_usec(&phase_start, &phase_end));
+
+    if (result == -1)
+    {
+      print_error_message(); // There was an error checking/registering built in commands.
+      return 1;
+    }
+    return builtin_status; // The commands were executed.
+  }
+
+  // Check if the program(s) is executable.
+  clock_gettime(CLOCK_MONOTONIC, &phase_start);
+  int valid = validate_input_format(argc, argv);
+  clock_gettime(CLOCK_MONOTONIC, &phase_end);
+  if (profile_path != NULL)
+    profile_record_phase(NULL, PROFILEVALIDATE, elapsed_usec(&phase_start, &phase_end));
+
+  if (valid != 0)
+  {
+    print_error_message();
+    return valid == -2 ? 127 : 1;
+  }
+
+  // Execute the program calls.
+  return execute_programs(argc, argv, first_index, cancel_on_failure);
+}
+
+/**
+ * Convert a wait status into an exit status: the exit code of a child that exited, or 128 plus the signal number
+ * of a child that was killed.
+ *
+ * Input:
+ *    int status: the status reported by wait.
+ *
+ * Output:
+ *    The exit status.
+ */
+int exit_code(int status)
+{
+  if (WIFEXITED(status))
+    return WEXITSTATUS(status);
+  if (WIFSIGNALED(status))
+    return 128 + WTERMSIG(status);
+  return 1;
+}
+
+/**
+ * This function will parse input delimited by '&'. This function will check the internal paths for an executable
+ * binary for each call of greater than or equal to one arguments delimited by the '&'. If there is a valid path,
+ * the program continues. Otherwise, the function halts and returns. A valid input must be delimited by '&'.
+ * There should be no empty calls between or after the delimiter. Otherwise, the function returns an error result.
+ * Additionally, the function validates whether or not the proper standards for redirecting output are used.
+ *
+ * Input:
+ *    int argc: the number of arguments given to command line.
+ *    char *argv[]: an array of the arguments passed to this program.
+ *
+ * Output:
+ *    0 - If all program calls were valid and have an executable path.
+ *   -1 - If any program calls are invalid.
+ *   -2 - If the program calls are valid, but a program could not be found.
+ */
+int validate_input_format(int argc, char *argv[])
+{
+  // Create variables.
+  int cnt = 0, current_cnt = 0;
+  int result = 0;
+
+  while (cnt < argc + 1)
+  {
+    // Check if the current portion is delimited.
+    if (argv[cnt] == NULL || is_operator(argv[cnt], "&"))
+    {
+      if (current_cnt > 0) // There are more than 0 arguments.
+      {
+        // Skip over any prefix, such as a timeout, in front of the command.
+        long timeout_ms;
+        int skip = parse_segment_prefix(current_cnt, &argv[cnt - current_cnt], &timeout_ms);
+        if (skip == -1)
+        {
+          return -1;
+        }
+        char **seg_argv = &argv[cnt - current_cnt + skip];
+        int seg_argc = current_cnt - skip;
+
+        // Attempt to find the binary.
+        char *fpath = validate_path(seg_argv[0]);
+
+        // Check if it worked, but keep checking the format of the rest.
+        if (fpath == NULL)
+        {
+          result = -2;
+        }
+        else
+        {
+          free(fpath);
+        }
+
+        // Check that there is a valid io redirect format.
+        int redir = validate_io_redirect_format(seg_argc, seg_argv);
+        if (redir == -1)
+        {
+          return -1;
+        }
+
+        // Check that a compressed redirect target has a compressor.
+        if (redir == 1 && has_compressed_suffix(seg_argv[seg_argc - 1]))
+        {
+          char *cpath = find_compressor(seg_argv[seg_argc - 1], NULL);
+          if (cpath == NULL)
+          {
+            return -1;
+          }
+          free(cpath);
+        }
+
+        // Reset the current counts.
+        current_cnt = 0;
+      }
+    }
+    else
+    {
+      current_cnt++;
+    }
+    cnt++;
+  }
+
+  return result;
+}
+
+/**
+ * This function will take a sequence of program arguments and determine if
+ * the arguments follow a valid IO redirect format.
+ *
+ * Input:
+ *    int argc: the number of arguments given to command line.
+ *    char *argv[]: an array of the arguments passed to this program.
+ *
+ * Output:
+ *    1 - If no arguments were passed to the function.
+ *    1 - If all program calls use a valid IO redirect format.
+ *   -1 - If any program calls are invalid.
+ */
+int validate_io_redirect_format(int argc, char *argv[])
+{
+  // Variables to validate the redirecting strings.
+  int cnt = 0;
+  int ans = 0;
+
+  // Iterate through a portion of the array.
+  while (argv[cnt] != NULL && !is_operator(argv[cnt], "&"))
+  {
+    // If any argument besides arguments n-1 is a valid redirect strings.
+    if (is_operator(argv[cnt], ">"))
+    {
+      if (cnt == argc - 2 && cnt > 0)
+      {
+        // The format is valid.
+        ans = 1;
+      }
+      else
+      {
+        return -1; // The format is incorrect.
+      }
+    }
+
+    // increment count.
+    ++cnt;
+  }
+
+  // The format is correct.
+  return ans;
+}
+
+/**
+ * Find the suffix of the file name in a path, starting at its last '.'.
+ *
+ * Input:
+ *    const char *path: the path of the file.
+ *
+ * Output:
+ *    A pointer to the suffix within the path, or an empty string if the file name has none.
+ */
+const char *get_file_suffix(const char *path)
+{
+  const char *name = strrchr(path, '/');
+  name = (name != NULL) ? name + 1 : path;
+
+  const char *dot = strrchr(name, '.');
+  if (dot == NULL || dot == name)
+    return "";
+  return dot;
+}
+
+/**
+ * Check whether output redirected to a path should be compressed, based on its suffix.
+ *
+ * Input:
+ *    const char *path: the redirect target.
+ *
+ * Output:
+ *    true - If the suffix belongs to a compressor.
+ *    false - Otherwise.
+ */
+bool has_compressed_suffix(const char *path)
+{
+  const char *suffix = get_file_suffix(path);
+  for (size_t i = 0; i < COMPRESSORNUM; i++)
+  {
+    if (strcmp(suffix, compressors[i].suffix) == 0)
+      return true;
+  }
+  return false;
+}
+
+/**
+ * Find an installed compressor for a redirect target. The program paths are searched first, then the standard
+ * directories, so compressed redirects keep working after the path has been changed. The returned path is alloced
+ * and should be freed after it is not needed.
+ *
+ * Input:
+ *    const char *path: the redirect target.
+ *    struct compressor **found: where the chosen compressor is stored, if not NULL.
+ *
+ * Output:
+ *    The path of the compressor, or NULL if the suffix has no installed compressor.
+ */
+char *find_compressor(const char *path, struct compressor **found)
+{
+  const char *suffix = get_file_suffix(path);
+  const char *standard_paths[] = {"/usr/bin/", "/bin/"};
+
+  for (size_t i = 0; i < COMPRESSORNUM; i++)
+  {
+    if (strcmp(suffix, compressors[i].suffix) != 0)
+      continue;
+
+    char *cpath = validate_path(compressors[i].argv[0]);
+    for (int j = 0; cpath == NULL && j < 2; j++)
+    {
+      cpath = malloc(strlen(standard_paths[j]) + strlen(compressors[i].argv[0]) + 1);
+      sprintf(cpath, "%s%s", standard_paths[j], compressors[i].argv[0]);
+      if (access(cpath, X_OK) == -1)
+      {
+        free(cpath);
+        cpath = NULL;
+      }
+    }
+
+    if (cpath != NULL)
+    {
+      if (found != NULL)
+        *found = &compressors[i];
+      return cpath;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * This function converts a duration string into milliseconds. A duration is a non-negative number, which may be
+ * fractional, followed by an optional unit: 'ms', 's', 'm', 'h' or 'd'. A number without a unit is in seconds.
+ *
+ * Input:
+ *    const char *str: the duration string.
+ *
+ * Output:
+ *    The duration in milliseconds, or -1 if the string is not a valid duration.
+ */
+long parse_duration(const char *str)
+{
+  char *end;
+  double value = strtod(str, &end);
+  if (end == str || !isfinite(value) || value < 0)
+    return -1;
+
+  // Scale the value by its unit.
+  double scale;
+  if (strcmp(end, "") == 0 || strcmp(end, "s") == 0)
+    scale = 1000;
+  else if (strcmp(end, "ms") == 0)
+    scale = 1;
+  else if (strcmp(end, "m") == 0)
+    scale = 60 * 1000;
+  else if (strcmp(end, "h") == 0)
+    scale = 60 * 60 * 1000;
+  else if (strcmp(end, "d") == 0)
+    scale = 24 * 60 * 60 * 1000;
+  else
+    return -1;
+
+  // Reject durations that do not fit in a long before converting them.
+  if (value * scale + 0.5 >= (double)LONG_MAX)
+    return -1;
+  return (long)(value * scale + 0.5);
+}
+
+/**
+ * This function checks a command segment for a 'timeout DURATION' prefix. If there is one, the duration is stored
+ * and the number of prefix arguments is returned so the caller can skip them. Otherwise, the shell-wide default
+ * deadline is stored. A prefix must be followed by at least one argument for the command itself.
+ *
+ * Input:
+ *    int argc: the number of arguments in the segment.
+ *    char *argv[]: the arguments of the segment.
+ *    long *timeout_ms: where the deadline for the segment is stored (0 for none).
+ *
+ * Output:
+ *    The number of prefix arguments (0 or 2), or -1 if the prefix is invalid.
+ */
+int parse_segment_prefix(int argc, char *argv[], long *timeout_ms)
+{
+  *timeout_ms = default_timeout_ms;
+
+  if (argc > 0 && strcmp(argv[0], "timeout") == 0)
+  {
+    if (argc < 3)
+      return -1; // There is no command after the duration.
+
+    long ms = parse_duration(argv[1]);
+    if (ms < 0)
+      return -1;
+
+    *timeout_ms = ms;
+    return 2;
+  }
+
+  return 0;
+}
+
+/**
+ * This function executes a single process with the given arguments and argument count. 
+ * It will handle the IO redirect if one is specified. This function assumes that the
+ * provided arguments are valid and in a valid format. If an error occurs, this process
+ * will exit immediatly and IO redirection will be unresolved. Thus, the state is 
+ * uncertain in that case.
+ * 
+ * Input:
+ *    int argc: the number of arguments given to command line.
+ *    char *argv[]: an array of the arguments passed to this program.
+ *    int out_fd: an already open descriptor for the redirect, such as a compressor pipe, or -1 to open the file.
+ *    int in_fd: a memory file to use as standard input, or -1 to keep the shell's.
+ */
+void execute_process(int argc, char *argv[], int out_fd, int in_fd)
+{
+  char *temp;
+  int save_out;
+  int out;
+
+  // Read standard input from the memory file. It is reopened so that every copy of the segment has its own offset.
+  if (in_fd != -1)
+  {
+    char fd_path[64];
+    snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", in_fd);
+    int in = open(fd_path, O_RDONLY | O_CLOEXEC);
+    if (in == -1)
+    {
+      in = in_fd;
+      lseek(in, 0, SEEK_SET);
+    }
+    if (-1 == dup2(in, STDIN_FILENO))
+    {
+      _exit(1);
+    }
+  }
+
+  // Check if a redirect is necessary.
+  int redir = validate_io_redirect_format(argc, argv);
+
+  if (redir == 1) // If an output file is provided.
+  {
+    // Open the file for output, unless it is written through a compressor.
+    out = (out_fd != -1) ? out_fd : open(argv[argc - 1], O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (-1 == out) // There was an error opening the file.
+    {
+      _exit(1);
+    }
+
+    save_out = dup(fileno(stdout));
+    if (-1 == dup2(out, fileno(stdout)))
+    {
+      // Something went wrong.
+      _exit(1);
+    }
+
+    // Lastly, restrict the arguments.
+    temp = argv[argc - 2];
+    argv[argc - 2] = NULL;
+  }
+
+  // Run the process here, given the correct arguments.
+  char *fpath = validate_path(argv[0]); // Should not return NULL at this point.
+  execv(fpath, argv);                   // Execute the process.
+  free(fpath);
+
+  // End the process.
+  if (redir == 1)
+  {
+    argv[argc - 2] = temp;
+    fflush(stdout);
+    close(out);
+    dup2(save_out, fileno(stdout));
+    close(save_out);
+  }
+  _exit(127); // The program could not be executed.
+}
+
+/**
+ * This function will parse any programs delimited by the '&'. This function will fork and run the programs in parallel.
+ * This function assumes that all programs delimited by the '&' are valid calls. If no arguments are passed between
+ * delimiters, then the function skip that call. Each segment is supervised until it finishes, is killed by its
+ * deadline, or loses to a hedged copy of itself.
+ *
+ * Input:
+ *    int argc: the number of arguments given to command line.
+ *    char *argv[]: an array of the arguments passed to this program.
+ *    int first_index: the index of the first segment within the line.
+ *    bool cancel_on_failure: whether the first failing segment cancels the others.
+ *
+ * Output:
+ *    The exit status of the first segment to fail, or 0 if none failed.
+ *
+ */
+int execute_programs(int argc, char *argv[], int first_index, bool cancel_on_failure)
+{
+  struct segment segments[MAXSEGNUM];
+  int n = 0;
+  int index = first_index;
+  int cnt = 0;
+  int current_cnt = 0;
+
+  while (cnt < argc + 1)
+  {
+    if (argv[cnt] == NULL || is_operator(argv[cnt], "&"))
+    {
+      // Block the array.
+      if (argv[cnt] != NULL)
+      {
+        free(argv[cnt]);
+        argv[cnt] = NULL;
+      }
+
+      // Skip segments that completed before the run was interrupted.
+      if (current_cnt > 0 && loop_depth == 0 && line_number == resume_partial_line &&
+          (resume_partial_mask & (1ULL << index)))
+      {
+        index++;
+        current_cnt = 0;
+      }
+
+      if (current_cnt > 0 && n < MAXSEGNUM) // There is an adequate number of arguments.
+      {
+        // Set up the segment, without any prefix arguments.
+        struct segment *seg = &segments[n];
+        seg->index = index++;
+        int skip = parse_segment_prefix(current_cnt, &argv[cnt - current_cnt], &seg->timeout_ms);
+        seg->argc = current_cnt - skip;
+        seg->argv = &argv[cnt - current_cnt + skip];
+        seg->stdin_fd = segment_stdin[seg->index];
+        seg->timerfd = -1;
+        seg->timer_stage = 0;
+        seg->attempt_count = 0;
+        seg->helper.live = false;
+        seg->helper.pidfd = -1;
+        seg->winner = -1;
+        seg->launched = false;
+        seg->exited = false;
+        seg->done = false;
+        seg->status = 0;
+        seg->helper_status = 0;
+
+        // Update variables.
+        n++;             // Number of programs grows.
+      }
+      current_cnt = 0; // Number of current arguments goes back to zero.
+    }
+    else
+    {
+      current_cnt++; // Increment number of current arguments.
+    }
+
+    cnt++; // Increment count;
+  }
+
+  // While hedging, hold the output of every segment that may be hedged, so only the winning copy's is shown.
+  for (int i = 0; i < n; i++)
+  {
+    segments[i].capture = hedge_percentile > 0 && n >= 2 &&
+                          validate_io_redirect_format(segments[i].argc, segments[i].argv) != 1;
+  }
+
+  /* Start the children and wait for them to exit. */
+  int status = wait_for_segments(segments, n, cancel_on_failure);
+
+  // Record how each segment ran.
+  if (profile_path != NULL)
+  {
+    for (int i = 0; i < n; i++)
+    {
+      if (segments[i].launched && segments[i].attempt_count > 0)
+        profile_record_segment(&segments[i]);
+    }
+  }
+
+  return status;
+}
+
+/**
+ * This function forks a new copy of a segment and records it as one of the segment's attempts. A pidfd is opened
+ * for the child when the kernel supports it, so that it can be polled and signalled without racing against pid reuse.
+ * If the segment's output is captured, the copy writes its standard output and error to memory files of its own.
+ *
+ * Input:
+ *    struct segment *seg: the segment to run.
+ *
+ * Output:
+ *    0 - If the child was started.
+ *   -1 - If the child or its compressor could not be started.
+ */
+int launch_attempt(struct segment *seg)
+{
+  // When profiling, a close-on-exec pipe tells us when the child has reached exec.
+  int exec_pipe[2] = {-1, -1};
+  if (profile_path != NULL && seg->attempt_count == 0 && pipe2(exec_pipe, O_CLOEXEC) == -1)
+  {
+    exec_pipe[0] = exec_pipe[1] = -1;
+  }
+
+  // Send compressed redirects through a compressor first.
+  int out_fd = -1;
+  if (seg->attempt_count == 0 && launch_compressor(seg, &out_fd) == -1)
+  {
+    if (exec_pipe[0] != -1)
+    {
+      close(exec_pipe[0]);
+      close(exec_pipe[1]);
+    }
+    return -1;
+  }
+
+  // Give a captured copy its own output files.
+  int capture_out = -1;
+  int capture_err = -1;
+  if (seg->capture)
+  {
+    capture_out = memfd_create("lsh-output", MFD_CLOEXEC);
+    capture_err = memfd_create("lsh-error", MFD_CLOEXEC);
+  }
+
+  pid_t rc;
+  if ((rc = fork()) < 0)
+  {
+    if (exec_pipe[0] != -1)
+    {
+      close(exec_pipe[0]);
+      close(exec_pipe[1]);
+    }
+    if (out_fd != -1)
+      close(out_fd);
+    if (capture_out != -1)
+      close(capture_out);
+    if (capture_err != -1)
+      close(capture_err);
+    return -1;
+  }
+  else if (rc == 0)
+  {
+    // Run the segment in its own process group.
+    if (own_process_groups)
+      setpgid(0, 0);
+    if (capture_out != -1 && dup2(capture_out, STDOUT_FILENO) == -1)
+      _exit(1);
+    if (capture_err != -1 && dup2(capture_err, STDERR_FILENO) == -1)
+      _exit(1);
+    execute_process(seg->argc, seg->argv, out_fd, seg->stdin_fd);
+  }
+  if (own_process_groups)
+    setpgid(rc, rc);
+
+  // Only the child writes to the compressor.
+  if (out_fd != -1)
+    close(out_fd);
+
+  // Wait for the child to exec (or exit), which closes the pipe.
+  if (exec_pipe[0] != -1)
+  {
+    char c;
+    close(exec_pipe[1]);
+    while (read(exec_pipe[0], &c, 1) == -1 && errno == EINTR)
+      ;
+    close(exec_pipe[0]);
+  }
+  if (seg->attempt_count == 0)
+    clock_gettime(CLOCK_MONOTONIC, &seg->spawned);
+
+  struct attempt *att = &seg->attempts[seg->attempt_count++];
+  att->pid = rc;
+  att->live = true;
+  att->out_fd = capture_out;
+  att->err_fd = capture_err;
+#ifdef SYS_pidfd_open
+  att->pidfd = syscall(SYS_pidfd_open, rc, 0);
+#else
+  att->pidfd = -1;
+#endif
+  return 0;
+}
+
+/**
+ * If a segment redirects its output to a compressed file, start the segment's compressor. The compressor reads
+ * from a pipe and writes the compressed stream to the target file, so raw output never reaches the disk. The
+ * compressor is the segment's helper, and the segment is not complete until it has exited.
+ *
+ * Input:
+ *    struct segment *seg: the segment to start a compressor for.
+ *    int *pipe_fd: where the write end of the compressor's pipe is stored, or -1 if there is no compressor.
+ *
+ * Output:
+ *    0 - If the compressor was started, or none was needed.
+ *   -1 - If there was an error.
+ */
+int launch_compressor(struct segment *seg, int *pipe_fd)
+{
+  *pipe_fd = -1;
+  if (validate_io_redirect_format(seg->argc, seg->argv) != 1)
+    return 0;
+
+  struct compressor *compressor;
+  char *cpath = find_compressor(seg->argv[seg->argc - 1], &compressor);
+  if (cpath == NULL)
+    return 0;
+
+  // Open the target and the pipe to the compressor.
+  int fds[2];
+  int out = open(seg->argv[seg->argc - 1], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (out == -1 || pipe2(fds, O_CLOEXEC) == -1)
+  {
+    if (out != -1)
+      close(out);
+    free(cpath);
+    return -1;
+  }
+
+  pid_t rc;
+  if ((rc = fork()) < 0)
+  {
+    close(out);
+    close(fds[0]);
+    close(fds[1]);
+    free(cpath);
+    return -1;
+  }
+  else if (rc == 0)
+  {
+    // Compress the pipe into the target.
+    if (dup2(fds[0], STDIN_FILENO) == -1 || dup2(out, STDOUT_FILENO) == -1)
+      _exit(1);
+    execv(cpath, compressor->argv);
+    _exit(1);
+  }
+
+  close(out);
+  close(fds[0]);
+  free(cpath);
+
+  seg->helper.pid = rc;
+  seg->helper.live = true;
+#ifdef SYS_pidfd_open
+  seg->helper.pidfd = syscall(SYS_pidfd_open, rc, 0);
+#else
+  seg->helper.pidfd = -1;
+#endif
+
+  *pipe_fd = fds[1];
+  return 0;
+}
+
+/**
+ * Send a signal to a running attempt. If the attempt leads its own process group, the whole group is signalled,
+ * which is safe because the group cannot be reused until the attempt is reaped. Otherwise, the attempt is
+ * signalled through its pidfd if it has one.
+ *
+ * Input:
+ *    struct attempt *att: the attempt to signal.
+ *    int sig: the signal to send.
+ *
+ * Output:
+ *    0 - If the signal was sent.
+ *   -1 - If there was an error.
+ */
+int signal_attempt(struct attempt *att, int sig)
+{
+  if (!att->live)
+    return 0;
+
+  if (own_process_groups && killpg(att->pid, sig) == 0)
+    return 0;
+
+#ifdef SYS_pidfd_send_signal
+  if (att->pidfd != -1)
+    return syscall(SYS_pidfd_send_signal, att->pidfd, sig, NULL, 0) == -1 ? -1 : 0;
+#endif
+  return kill(att->pid, sig);
+}
+
+/**
+ * Arm (or re-arm) the deadline timer of a segment to fire once after the given number of milliseconds.
+ *
+ * Input:
+ *    struct segment *seg: the segment to time.
+ *    long ms: the number of milliseconds until the timer fires.
+ *
+ * Output:
+ *    0 - If the timer was armed.
+ *   -1 - If there was an error.
+ */
+int arm_segment_timer(struct segment *seg, long ms)
+{
+  if (seg->timerfd == -1)
+  {
+    seg->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (seg->timerfd == -1)
+      return -1;
+  }
+
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  spec.it_value.tv_sec = ms / 1000;
+  spec.it_value.tv_nsec = (ms % 1000) * 1000000;
+  return timerfd_settime(seg->timerfd, 0, &spec, NULL);
+}
+
+/**
+ * Handle an expired deadline timer. The first expiry asks every copy of the segment to terminate and starts the
+ * grace period. If the segment is still running when the grace period expires, it is killed.
+ *
+ * Input:
+ *    struct segment *seg: the segment whose timer fired.
+ */
+void handle_segment_timer(struct segment *seg)
+{
+  uint64_t expirations;
+  if (read(seg->timerfd, &expirations, sizeof(expirations)) == -1)
+    return;
+
+  int sig = (seg->timer_stage == 1) ? SIGTERM : SIGKILL;
+  for (int i = 0; i < seg->attempt_count; i++)
+  {
+    signal_attempt(&seg->attempts[i], sig);
+  }
+
+  if (seg->timer_stage == 1 && arm_segment_timer(seg, KILLGRACEMS) == 0)
+    seg->timer_stage = 2;
+  else
+    seg->timer_stage = 3;
+}
+
+/**
+ * Reap any attempts of a segment that have exited. The first attempt to exit decides the segment, and any other
+ * attempt still running is killed as the loser of the hedge. The segment completes once its helper, if it has
+ * one, has exited as well. If the command succeeded but its helper failed, the segment has the helper's status.
+ *
+ * Input:
+ *    struct segment *seg: the segment to check.
+ *
+ * Output:
+ *    1 - If this call completed the segment.
+ *    0 - Otherwise.
+ */
+int reap_segment_attempts(struct segment *seg)
+{
+  int completed = 0;
+
+  for (int i = 0; i < seg->attempt_count; i++)
+  {
+    struct attempt *att = &seg->attempts[i];
+    int status;
+    struct rusage usage;
+    if (!att->live || wait4(att->pid, &status, WNOHANG, &usage) <= 0)
+      continue;
+
+    att->live = false;
+    if (att->pidfd != -1)
+    {
+      close(att->pidfd);
+      att->pidfd = -1;
+    }
+
+    if (!seg->exited)
+    {
+      // The first copy to exit wins.
+      seg->exited = true;
+      seg->winner = i;
+      seg->status = status;
+      seg->usage = usage;
+
+      if (seg->timerfd != -1)
+      {
+        close(seg->timerfd);
+        seg->timerfd = -1;
+      }
+
+      for (int j = 0; j < seg->attempt_count; j++)
+      {
+        signal_attempt(&seg->attempts[j], SIGKILL);
+      }
+    }
+  }
+
+  // Reap the helper, which finishes once the command's output has been flushed.
+  if (seg->helper.live && waitpid(seg->helper.pid, &seg->helper_status, WNOHANG) > 0)
+  {
+    seg->helper.live = false;
+    if (seg->helper.pidfd != -1)
+    {
+      close(seg->helper.pidfd);
+      seg->helper.pidfd = -1;
+    }
+  }
+
+  if (!seg->done && seg->exited && !seg->helper.live)
+  {
+    seg->done = true;
+    clock_gettime(CLOCK_MONOTONIC, &seg->end);
+    flush_captured_output(seg);
+
+    // Output that was not written out in full is a failure, even if the command succeeded.
+    if (exit_code(seg->status) == 0 && exit_code(seg->helper_status) != 0)
+      seg->status = seg->helper_status;
+    completed = 1;
+  }
+
+  return completed;
+}
+
+/**
+ * Copy the captured output of a segment's winning copy to the shell's standard output and error, and release the
+ * memory files of every copy. The output of the losing copy is discarded.
+ *
+ * Input:
+ *    struct segment *seg: the segment that has completed.
+ */
+void flush_captured_output(struct segment *seg)
+{
+  fflush(stdout);
+  fflush(stderr);
+
+  for (int i = 0; i < seg->attempt_count; i++)
+  {
+    struct attempt *att = &seg->attempts[i];
+    int fds[2] = {att->out_fd, att->err_fd};
+    for (int k = 0; k < 2; k++)
+    {
+      if (fds[k] == -1)
+        continue;
+
+      if (i == seg->winner)
+      {
+        char buffer[BUFSIZ];
+        ssize_t len;
+        lseek(fds[k], 0, SEEK_SET);
+        while ((len = read(fds[k], buffer, sizeof(buffer))) > 0)
+        {
+          for (ssize_t off = 0; off < len;)
+          {
+            ssize_t written = write(k == 0 ? STDOUT_FILENO : STDERR_FILENO, buffer + off, len - off);
+            if (written == -1 && errno == EINTR)
+              continue;
+            if (written <= 0)
+              break;
+            off += written;
+          }
+        }
+      }
+      close(fds[k]);
+    }
+    att->out_fd = att->err_fd = -1;
+  }
+}
+
+/**
+ * Launch a second copy of every straggling segment in a parallel group. A segment straggles once the hedge percentile
+ * of the group has completed and it is still running. Each segment is hedged at most once, and only if its output is
+ * being captured, so that the output of the losing copy can be thrown away. A segment that is already being stopped
+ * by its deadline is never hedged, and no copy is started while the concurrency limit is reached.
+ *
+ * Input:
+ *    struct segment segments[]: the segments of the group.
+ *    int n: the number of segments in the group.
+ *    int completed: the number of segments in the group that have completed.
+ */
+void hedge_stragglers(struct segment segments[], int n, int completed)
+{
+  if (hedge_percentile <= 0 || n < 2 || completed >= n)
+    return;
+
+  // Wait until the percentile of the group has finished.
+  int needed = (n * hedge_percentile + 99) / 100;
+  if (needed < 1)
+    needed = 1;
+  if (completed < needed)
+    return;
+
+  int running = count_running(segments, n);
+  for (int i = 0; i < n; i++)
+  {
+    struct segment *seg = &segments[i];
+    if (!seg->launched || seg->done || !seg->capture || seg->attempt_count > 1 || seg->timer_stage > 1)
+      continue;
+    if (concurrency.mode != CONCURRENCYOFF && running >= concurrency.limit)
+      break;
+
+    if (launch_attempt(seg) == 0)
+      running++;
+  }
+}
+
+/**
+ * Cancel every segment of a group that has not completed. Segments that have not started are never started, and
+ * running ones are killed along with their process groups. A helper is left to flush what its command wrote.
+ *
+ * Input:
+ *    struct segment segments[]: the segments of the group.
+ *    int n: the number of segments in the group.
+ */
+void cancel_segments(struct segment segments[], int n)
+{
+  for (int i = 0; i < n; i++)
+  {
+    struct segment *seg = &segments[i];
+    if (seg->done)
+      continue;
+
+    if (!seg->launched)
+    {
+      seg->launched = true;
+      seg->exited = true;
+      seg->done = true;
+      continue;
+    }
+
+    for (int j = 0; j < seg->attempt_count; j++)
+    {
+      signal_attempt(&seg->attempts[j], SIGKILL);
+    }
+  }
+}
+
+/**
+ * This function starts the segments and waits until every attempt of every segment has exited. Segments are started
+ * as the concurrency limit allows. It polls the pidfds of the children together with the deadline timers of the
+ * segments, so that deadlines and hedges are handled while the group is running. If the kernel does not provide
+ * pidfds, the children are polled for instead.
+ *
+ * Input:
+ *    struct segment segments[]: the segments of the group.
+ *    int n: the number of segments in the group.
+ *    bool cancel_on_failure: whether the first failing segment cancels the others.
+ *
+ * Output:
+ *    The exit status of the first segment to fail, or 0 if none failed.
+ */
+int wait_for_segments(struct segment segments[], int n, bool cancel_on_failure)
+{
+  int completed = 0;
+  int started = 0;
+  int failure = 0;
+
+  // Let a signal to the shell stop these children.
+  struct segment *outer_segments = active_segments;
+  int outer_count = active_segment_count;
+  active_segment_count = n;
+  active_segments = segments;
+
+  while (1)
+  {
+    // Start as many waiting segments as the limit allows.
+    if (started < n)
+    {
+      launch_pending_segments(segments, n, count_running(segments, n));
+      started = 0;
+      for (int i = 0; i < n; i++)
+      {
+        started += segments[i].launched;
+      }
+    }
+
+    struct pollfd fds[MAXSEGNUM * 4];
+    struct segment *owners[MAXSEGNUM * 4];
+    int nfds = 0;
+    int live = 0;
+    bool fallback = false;
+    bool ready = false;
+
+    // Gather every descriptor to wait on.
+    for (int i = 0; i < n; i++)
+    {
+      struct segment *seg = &segments[i];
+      if (seg->exited && !seg->done && !seg->helper.live)
+        ready = true; // A segment that failed to start is waiting to be collected.
+      for (int j = 0; j <= seg->attempt_count; j++)
+      {
+        struct attempt *att = (j < seg->attempt_count) ? &seg->attempts[j] : &seg->helper;
+        if (!att->live)
+          continue;
+
+        live++;
+        if (att->pidfd == -1)
+        {
+          fallback = true;
+          continue;
+        }
+        fds[nfds].fd = att->pidfd;
+        fds[nfds].events = POLLIN;
+        owners[nfds++] = NULL;
+      }
+
+      if (seg->timerfd != -1)
+      {
+        fds[nfds].fd = seg->timerfd;
+        fds[nfds].events = POLLIN;
+        owners[nfds++] = seg;
+      }
+    }
+
+    if (live == 0 && !ready)
+      break;
+
+    // Wake up in time to sync any journal records that are waiting.
+    long wait_ms = journal_flush(false);
+    if (fallback && (wait_ms == -1 || wait_ms > REAPPOLLMS))
+      wait_ms = REAPPOLLMS;
+    if (started < n && (wait_ms == -1 || wait_ms > CONTROLINTERVALMS))
+      wait_ms = CONTROLINTERVALMS;
+
+    // Read the next lines while the children run, checking on them between lines.
+    if (lookahead_step() == 1 || ready)
+      wait_ms = 0;
+
+    if (poll(fds, nfds, wait_ms) == -1 && errno != EINTR)
+      break;
+
+    // The handler has already killed the children, so the shell can stop now.
+    if (caught_signal != 0)
+      finish_on_signal(caught_signal);
+
+    // Handle any deadlines that have passed.
+    for (int i = 0; i < nfds; i++)
+    {
+      if (owners[i] != NULL && (fds[i].revents & POLLIN))
+        handle_segment_timer(owners[i]);
+    }
+
+    // Collect the children that have exited.
+    for (int i = 0; i < n; i++)
+    {
+      if (reap_segment_attempts(&segments[i]) == 1)
+      {
+        completed++;
+        int code = exit_code(segments[i].status);
+        if (code == 0)
+        {
+          // Segments inside a loop run many times, so only the whole line is recorded.
+          if (loop_depth == 0)
+            journal_record("S %d %d\n", line_number, segments[i].index);
+        }
+        else if (failure == 0)
+        {
+          // The first failure decides the group.
+          failure = code;
+          if (cancel_on_failure)
+          {
+            cancel_segments(segments, n);
+            started = n;
+          }
+        }
+      }
+    }
+
+    hedge_stragglers(segments, n, completed);
+  }
+
+  active_segments = outer_segments;
+  active_segment_count = outer_count;
+  return failure;
+}
+
+/**
+ * Catch the signals that stop the shell, so that its children are stopped with it. When the children have their
+ * own process groups, a signal to the shell's group no longer reaches them.
+ */
+void install_signal_handlers()
+{
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = handle_termination_signal;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+
+  int signals[] = {SIGINT, SIGTERM, SIGHUP};
+  for (size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); i++)
+  {
+    sigaddset(&action.sa_mask, signals[i]);
+  }
+  for (size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); i++)
+  {
+    sigaction(signals[i], &action, NULL);
+  }
+}
+
+/**
+ * Kill every running copy of the segments being waited on, along with their process groups. If the shell is
+ * waiting on them, it finishes up once it wakes; otherwise nothing is running and it finishes up at once, syncing
+ * the journal but leaving out the profile, which cannot be written safely from a signal handler.
+ *
+ * Input:
+ *    int sig: the signal that was caught.
+ */
+void handle_termination_signal(int sig)
+{
+  caught_signal = sig;
+  for (int i = 0; i < active_segment_count; i++)
+  {
+    for (int j = 0; j < active_segments[i].attempt_count; j++)
+    {
+      signal_attempt(&active_segments[i].attempts[j], SIGKILL);
+    }
+  }
+
+  if (active_segments == NULL)
+  {
+    if (journal_fd != -1)
+      fdatasync(journal_fd);
+    signal(sig, SIG_DFL);
+    raise(sig);
+  }
+}
+
+/**
+ * Stop the shell after a signal, once its children have been killed. The journal is synced and the profile written,
+ * and the signal is raised again so that the shell's parent sees how it ended.
+ *
+ * Input:
+ *    int sig: the signal that was caught.
+ */
+void finish_on_signal(int sig)
+{
+  journal_flush(true);
+  write_profile();
+  signal(sig, SIG_DFL);
+  raise(sig);
+  _exit(128 + sig);
+}
+
+/**
+ * Return the number of microseconds between two points in time.
+ *
+ * Input:
+ *    const struct timespec *from: the earlier time.
+ *    const struct timespec *to: the later time.
+ *
+ * Output:
+ *    The elapsed time in microseconds.
+ */
+long elapsed_usec(const struct timespec *from, const struct timespec *to)
+{
+  return (to->tv_sec - from->tv_sec) * 1000000L + (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+/**
+ * Store the text of the current line for the profiler. The arguments are joined by single spaces, so lines that
+ * only differ in whitespace are merged. Semicolons separate frames in the profile, so they are replaced.
+ *
+ * Input:
+ *    int argc: the number of arguments on the line.
+ *    char *argv[]: the arguments on the line.
+ */
+void set_line_text(int argc, char *argv[])
+{
+  int index = 0;
+  line_text[0] = '\0';
+  for (int i = 0; i < argc && index < MAXLINELENGTH - 1; i++)
+  {
+    index += snprintf(&line_text[index], MAXLINELENGTH - index, i == 0 ? "%s" : " %s", argv[i]);
+  }
+
+  for (char *c = line_text; *c != '\0'; c++)
+  {
+    if (*c == ';')
+      *c = ':';
+  }
+}
+
+/**
+ * Find the entry for a key in a profiler table, adding an empty entry if there is none. The table doubles in size
+ * whenever it becomes half full.
+ *
+ * Input:
+ *    struct profile_table *table: the table to search.
+ *    const char *key: the key to find.
+ *
+ * Output:
+ *    The entry for the key, or NULL if memory could not be allocated.
+ */
+struct profile_entry *profile_lookup(struct profile_table *table, const char *key)
+{
+  // Grow the table before it gets crowded.
+  if ((table->size + 1) * 2 > table->capacity)
+  {
+    size_t capacity = table->capacity == 0 ? 64 : table->capacity * 2;
+    struct profile_entry *entries = calloc(capacity, sizeof(struct profile_entry));
+    if (entries == NULL)
+      return NULL;
+
+    struct profile_table grown = {entries, capacity, 0};
+    for (size_t i = 0; i < table->capacity; i++)
+    {
+      if (table->entries[i].key != NULL)
+      {
+        struct profile_entry *entry = profile_lookup(&grown, table->entries[i].key);
+        free(entry->key);
+        *entry = table->entries[i];
+      }
+    }
+    free(table->entries);
+    *table = grown;
+  }
+
+  // Hash the key (FNV-1a).
+  size_t hash = 14695981039346656037UL;
+  for (const char *c = key; *c != '\0'; c++)
+  {
+    hash = (hash ^ (unsigned char)*c) * 1099511628211UL;
+  }
+
+  // Probe for the key or an empty slot.
+  size_t i = hash & (table->capacity - 1);
+  while (table->entries[i].key != NULL)
+  {
+    if (strcmp(table->entries[i].key, key) == 0)
+      return &table->entries[i];
+    i = (i + 1) & (table->capacity - 1);
+  }
+
+  table->entries[i].key = strdup(key);
+  table->entries[i].line = line_number;
+  table->size++;
+  return &table->entries[i];
+}
+
+/**
+ * Add the time spent in one phase of the current line to the profile. Phases that belong to the whole line, such
+ * as parsing, are recorded without a command.
+ *
+ * Input:
+ *    const char *cmd: the command the time belongs to, or NULL for the line itself.
+ *    int phase: the phase the time was spent in.
+ *    long usec: the time spent, in microseconds.
+ */
+void profile_record_phase(const char *cmd, int phase, long usec)
+{
+  char key[MAXLINELENGTH + MAXARGLEN + 1];
+  if (cmd == NULL)
+    snprintf(key, sizeof(key), "%s", line_text);
+  else
+    snprintf(key, sizeof(key), "%s;%s", line_text, cmd);
+
+  struct profile_entry *entry = profile_lookup(&profile_lines, key);
+  if (entry == NULL)
+    return;
+  if (phase == PROFILEPARSE || (cmd != NULL && phase == PROFILERUN))
+    entry->count++;
+  entry->usec[phase] += usec;
+
+  if (cmd != NULL && (entry = profile_lookup(&profile_commands, cmd)) != NULL)
+  {
+    if (phase == PROFILERUN)
+      entry->count++;
+    entry->usec[phase] += usec;
+  }
+}
+
+/**
+ * Add a finished segment to the profile: the time taken to spawn it, the time it ran for and the resources its
+ * winning child used.
+ *
+ * Input:
+ *    struct segment *seg: the finished segment.
+ */
+void profile_record_segment(struct segment *seg)
+{
+  profile_record_phase(seg->argv[0], PROFILESPAWN, elapsed_usec(&seg->start, &seg->spawned));
+  profile_record_phase(seg->argv[0], PROFILERUN, elapsed_usec(&seg->spawned, &seg->end));
+
+  long user_usec = seg->usage.ru_utime.tv_sec * 1000000L + seg->usage.ru_utime.tv_usec;
+  long sys_usec = seg->usage.ru_stime.tv_sec * 1000000L + seg->usage.ru_stime.tv_usec;
+
+  char key[MAXLINELENGTH + MAXARGLEN + 1];
+  snprintf(key, sizeof(key), "%s;%s", line_text, seg->argv[0]);
+  struct profile_entry *entries[2] = {profile_lookup(&profile_lines, key), profile_lookup(&profile_commands, seg->argv[0])};
+  for (int i = 0; i < 2; i++)
+  {
+    if (entries[i] == NULL)
+      continue;
+    entries[i]->user_usec += user_usec;
+    entries[i]->sys_usec += sys_usec;
+    if (seg->usage.ru_maxrss > entries[i]->maxrss)
+      entries[i]->maxrss = seg->usage.ru_maxrss;
+  }
+}
+
+/**
+ * Compare two profiler entries by their total time, largest first. Used with qsort.
+ */
+int compare_profile_entries(const void *a, const void *b)
+{
+  const struct profile_entry *x = *(const struct profile_entry **)a;
+  const struct profile_entry *y = *(const struct profile_entry **)b;
+  long total_x = 0, total_y = 0;
+  for (int i = 0; i < PROFILEPHASES; i++)
+  {
+    total_x += x->usec[i];
+    total_y += y->usec[i];
+  }
+  return (total_x < total_y) - (total_x > total_y);
+}
+
+/**
+ * Write the top entries of a profiler table to a report, sorted by total time.
+ *
+ * Input:
+ *    FILE *out: the report to write to.
+ *    struct profile_table *table: the table to report.
+ *    const char *title: the heading of the report section.
+ */
+void write_profile_section(FILE *out, struct profile_table *table, const char *title)
+{
+  struct profile_entry **sorted = malloc(sizeof(struct profile_entry *) * (table->size + 1));
+  if (sorted == NULL)
+    return;
+
+  size_t n = 0;
+  for (size_t i = 0; i < table->capacity; i++)
+  {
+    if (table->entries[i].key != NULL)
+      sorted[n++] = &table->entries[i];
+  }
+  qsort(sorted, n, sizeof(struct profile_entry *), compare_profile_entries);
+
+  fprintf(out, "%s\n", title);
+  fprintf(out, "%12s %6s %10s %10s %10s %12s %12s %12s %10s %6s  %s\n", "total(us)", "count", "parse", "validate",
+          "spawn", "run", "user", "sys", "maxrss(kb)", "line", "key");
+  for (size_t i = 0; i < n && i < PROFILETOPN; i++)
+  {
+    struct profile_entry *e = sorted[i];
+    long total = e->usec[PROFILEPARSE] + e->usec[PROFILEVALIDATE] + e->usec[PROFILESPAWN] + e->usec[PROFILERUN];
+    fprintf(out, "%12ld %6ld %10ld %10ld %10ld %12ld %12ld %12ld %10ld %6d  %s\n", total, e->count,
+            e->usec[PROFILEPARSE], e->usec[PROFILEVALIDATE], e->usec[PROFILESPAWN], e->usec[PROFILERUN],
+            e->user_usec, e->sys_usec, e->maxrss, e->line, e->key);
+  }
+  fprintf(out, "\n");
+  free(sorted);
+}
+
+/**
+ * Write the profile, if one was requested. The collapsed stacks ('script;line;command;phase usec') are written
+ * to the profile path, where they can be fed to flamegraph tools. A report of the slowest lines and commands is
+ * written next to it, with PROFILEREPORTSUFFIX appended to the name. Identical lines share an entry, which keeps
+ * the number of the first line they appeared on.
+ *
+ * Output:
+ *    1 - If the profile was written, or none was requested.
+ *    0 - If there was an error.
+ */
+int write_profile()
+{
+  if (profile_path == NULL)
+    return 1;
+
+  // Write the collapsed stacks.
+  FILE *folded = fopen(profile_path, "w");
+  if (folded == NULL)
+  {
+    print_error_message();
+    return 0;
+  }
+
+  for (size_t i = 0; i < profile_lines.capacity; i++)
+  {
+    struct profile_entry *e = &profile_lines.entries[i];
+    if (e->key == NULL)
+      continue;
+    for (int phase = 0; phase < PROFILEPHASES; phase++)
+    {
+      if (e->usec[phase] > 0)
+        fprintf(folded, "%s;%s;%s %ld\n", profile_script, e->key, profile_phase_names[phase], e->usec[phase]);
+    }
+  }
+  fclose(folded);
+
+  // Write the top-N report.
+  char *report_path = malloc(strlen(profile_path) + strlen(PROFILEREPORTSUFFIX) + 1);
+  sprintf(report_path, "%s%s", profile_path, PROFILEREPORTSUFFIX);
+  FILE *report = fopen(report_path, "w");
+  free(report_path);
+  if (report == NULL)
+  {
+    print_error_message();
+    return 0;
+  }
+  write_profile_section(report, &profile_lines, "Slowest lines");
+  write_profile_section(report, &profile_commands, "Slowest commands");
+  fclose(report);
+
+  // Only write the profile once.
+  profile_path = NULL;
+  return 1;
+}
+
+/**
+ * Open the journal for a batch file. The journal is an append-only list of records, one per line:
+ *    lsh-journal 2 SIZE MTIME   identifies the batch file the journal belongs to.
+ *    S LINE SEGMENT             a segment of a line has completed.
+ *    O TIMEOUT HEDGE MODE LIMIT,
+ *    C CWD,
+ *    R, P PATH                  the shell state (settings, directory and paths) after the next completed line.
+ *    D LINE                     a line has completed.
+ * When resuming, the existing journal is read and appended to. Otherwise, a new journal is started.
+ *
+ * Input:
+ *    const char *script: the path of the batch file.
+ *
+ * Output:
+ *    1 - If the journal was opened.
+ *    0 - If there was an error, or the journal belongs to a different version of the batch file.
+ */
+int open_journal(const char *script)
+{
+  struct stat script_stat;
+  if (fstat(fileno(in_stream), &script_stat) == -1)
+    return 0;
+
+  char *path = malloc(strlen(script) + strlen(JOURNALSUFFIX) + 1);
+  sprintf(path, "%s%s", script, JOURNALSUFFIX);
+
+  // Pick up an existing journal.
+  if (journal_mode == JOURNALRESUME)
+  {
+    int fd = open(path, O_RDWR | O_APPEND | O_CLOEXEC);
+    if (fd != -1)
+    {
+      free(path);
+      journal_fd = fd;
+      if (read_journal(fd, &script_stat) == 0)
+      {
+        close(fd);
+        journal_fd = -1;
+        return 0;
+      }
+      return 1;
+    }
+    else if (errno != ENOENT)
+    {
+      free(path);
+      return 0;
+    }
+  }
+
+  // Start a new journal, and make sure its directory entry is durable too.
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+  if (fd == -1)
+  {
+    free(path);
+    return 0;
+  }
+  dprintf(fd, "%s %lld %lld\n", JOURNALMAGIC, (long long)script_stat.st_size, (long long)script_stat.st_mtime);
+  fsync(fd);
+
+  int dir = open(dirname(path), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir != -1)
+  {
+    fsync(dir);
+    close(dir);
+  }
+  free(path);
+
+  journal_fd = fd;
+  return 1;
+}
+
+/**
+ * Read an existing journal to find out how far a previous run got. Lines up to the last completed line are skipped,
+ * the segments that completed on the line after it are not run again, and the shell state saved with the last
+ * completed line is restored. A record torn by a crash is cut off so that new records follow the last whole one.
+ *
+ * Input:
+ *    int fd: the open journal.
+ *    struct stat *script_stat: the status of the batch file, to check that the journal belongs to it.
+ *
+ * Output:
+ *    1 - If the journal was read.
+ *    0 - If there was an error.
+ */
+int read_journal(int fd, struct stat *script_stat)
+{
+  FILE *stream = fdopen(dup(fd), "r");
+  if (stream == NULL)
+    return 0;
+
+  char *record = NULL;
+  size_t len = 0;
+  ssize_t nread;
+  off_t valid_length = 0;
+  int done = 0, partial = 0;
+  uint64_t mask = 0;
+  char staged[JOURNALSTATESIZE] = "";
+  char committed[JOURNALSTATESIZE] = "";
+  bool valid = false;
+
+  while ((nread = getline(&record, &len, stream)) > 0 && record[nread - 1] == '\n')
+  {
+    int line, seg;
+    if (valid_length == 0)
+    {
+      // The first record must identify this batch file.
+      char header[64];
+      snprintf(header, sizeof(header), "%s %lld %lld\n", JOURNALMAGIC, (long long)script_stat->st_size,
+               (long long)script_stat->st_mtime);
+      if (strcmp(record, header) != 0)
+        break;
+      valid = true;
+    }
+    else if (record[0] == 'S' && sscanf(record, "S %d %d", &line, &seg) == 2)
+    {
+      if (line != partial)
+        mask = 0;
+      partial = line;
+      if (seg >= 0 && seg < 64)
+        mask |= 1ULL << seg;
+    }
+    else if (record[0] == 'D' && sscanf(record, "D %d", &line) == 1)
+    {
+      done = line;
+      strcpy(committed, staged);
+    }
+    else if (record[0] == 'O')
+    {
+      snprintf(staged, sizeof(staged), "%s", record);
+    }
+    else if (strchr("CRP", record[0]) != NULL && strlen(staged) + nread < sizeof(staged))
+    {
+      strcat(staged, record);
+    }
+    valid_length += nread;
+  }
+  free(record);
+  fclose(stream);
+
+  if (!valid || ftruncate(fd, valid_length) == -1)
+    return 0;
+
+  resume_done_line = done;
+  if (partial == done + 1)
+  {
+    resume_partial_line = partial;
+    resume_partial_mask = mask;
+  }
+
+  if (strcmp(committed, "") != 0)
+  {
+    strcpy(journal_state, committed);
+    return restore_journal_state(committed);
+  }
+  return 1;
+}
+
+/**
+ * Restore the shell state saved in the journal: the default timeout, the hedge percentile, the concurrency limit,
+ * the working directory and the program paths.
+ *
+ * Input:
+ *    const char *state: the state records, one per line.
+ *
+ * Output:
+ *    1 - If the state was restored.
+ *    0 - If there was an error.
+ */
+int restore_journal_state(const char *state)
+{
+  char *copy = strdup(state);
+  char *rest = copy;
+  char *record;
+  int ans = 1;
+
+  while ((record = strsep(&rest, "\n")) != NULL)
+  {
+    if (record[0] == 'O')
+    {
+      int checked = 0;
+      sscanf(record, "O %ld %d %d %d %d", &default_timeout_ms, &hedge_percentile, &concurrency.mode,
+             &concurrency.limit, &checked);
+      fail_fast = checked;
+    }
+    else if (record[0] == 'C')
+    {
+      if (chdir(&record[2]) != 0 || get_current_working_directory() == 0)
+        ans = 0;
+    }
+    else if (record[0] == 'R')
+    {
+      for (int i = 0; i < program_path_count; i++)
+      {
+        free(program_paths[i]);
+      }
+      program_path_count = 0;
+    }
+    else if (record[0] == 'P' && program_path_count < MAXPATHNUM)
+    {
+      program_paths[program_path_count++] = strdup(&record[2]);
+    }
+  }
+
+  free(copy);
+  path_generation++;
+  return ans;
+}
+
+/**
+ * Append a record to the journal. The record is written with a single call, but it is only synced to disk in
+ * batches by journal_flush.
+ *
+ * Input:
+ *    const char *format: a printf style format for the record.
+ */
+void journal_record(const char *format, ...)
+{
+  if (journal_fd == -1)
+    return;
+
+  va_list args;
+  va_start(args, format);
+  vdprintf(journal_fd, format, args);
+  va_end(args);
+
+  if (journal_pending++ == 0)
+    clock_gettime(CLOCK_MONOTONIC, &journal_pending_since);
+  journal_flush(false);
+}
+
+/**
+ * Sync the journal to disk if enough records are waiting, or the oldest has waited long enough. Batching the syncs
+ * keeps the journal from slowing down scripts with many short lines.
+ *
+ * Input:
+ *    bool force: sync any waiting records now.
+ *
+ * Output:
+ *    The number of milliseconds until the waiting records are due to be synced, or -1 if none are waiting.
+ */
+long journal_flush(bool force)
+{
+  if (journal_fd == -1 || journal_pending == 0)
+    return -1;
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  long waited_ms = elapsed_usec(&journal_pending_since, &now) / 1000;
+  if (force || journal_pending >= JOURNALSYNCRECORDS || waited_ms >= JOURNALSYNCMS)
+  {
+    fdatasync(journal_fd);
+    journal_pending = 0;
+    return -1;
+  }
+  return JOURNALSYNCMS - waited_ms;
+}
+
+/**
+ * Build the state records for the current shell state.
+ *
+ * Input:
+ *    char *state: a buffer of JOURNALSTATESIZE characters to fill.
+ */
+void build_journal_state(char *state)
+{
+  int index = snprintf(state, JOURNALSTATESIZE, "O %ld %d %d %d %d\nC %s\nR\n", default_timeout_ms,
+                       hedge_percentile, concurrency.mode, concurrency.limit, fail_fast, cwd);
+  for (int i = 0; i < program_path_count && index < JOURNALSTATESIZE; i++)
+  {
+    index += snprintf(&state[index], JOURNALSTATESIZE - index, "P %s\n", program_paths[i]);
+  }
+}
+
+/**
+ * Record that the current line has completed, along with the shell state if the line changed it.
+ */
+void journal_line_done()
+{
+  if (journal_fd == -1)
+    return;
+
+  char state[JOURNALSTATESIZE];
+  build_journal_state(state);
+  if (strcmp(state, journal_state) != 0)
+  {
+    strcpy(journal_state, state);
+    journal_record("%s", state);
+  }
+  journal_record("D %d\n", line_number);
+}
+
+/**
+ * Sync any waiting records and close the journal.
+ */
+void close_journal()
+{
+  if (journal_fd == -1)
+    return;
+
+  journal_flush(true);
+  close(journal_fd);
+  journal_fd = -1;
+}
+
+/**
+ * Start the segments of a group that are still waiting, in order, until the concurrency limit is reached.
+ *
+ * Input:
+ *    struct segment segments[]: the segments of the group.
+ *    int n: the number of segments in the group.
+ *    int running: the number of copies that are running, as counted by count_running.
+ */
+void launch_pending_segments(struct segment segments[], int n, int running)
+{
+  sample_concurrency(running);
+
+  for (int i = 0; i < n && running < concurrency.limit; i++)
+  {
+    struct segment *seg = &segments[i];
+    if (seg->launched)
+      continue;
+
+    // Start child process.
+    clock_gettime(CLOCK_MONOTONIC, &seg->start);
+    seg->launched = true;
+    if (launch_attempt(seg) == -1)
+    {
+      // The segment could not be started, so it fails without stopping the rest of the group.
+      print_error_message();
+      seg->exited = true;
+      seg->status = W_EXITCODE(1, 0);
+      continue;
+    }
+    running++;
+
+    // Start the deadline for the segment.
+    if (seg->timeout_ms > 0 && arm_segment_timer(seg, seg->timeout_ms) == 0)
+    {
+      seg->timer_stage = 1;
+    }
+  }
+}
+
+/**
+ * Read the share of time that tasks were stalled on a resource over the last ten seconds, from Linux pressure
+ * stall information.
+ *
+ * Input:
+ *    const char *resource: 'cpu', 'memory' or 'io'.
+ *
+ * Output:
+ *    The 'some avg10' percentage, or -1 if pressure information is not available.
+ */
+double read_pressure(const char *resource)
+{
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/pressure/%s", resource);
+  FILE *stream = fopen(path, "r");
+  if (stream == NULL)
+    return -1;
+
+  double avg10;
+  if (fscanf(stream, "some avg10=%lf", &avg10) != 1)
+    avg10 = -1;
+  fclose(stream);
+  return avg10;
+}
+
+/**
+ * Count the running copies of the segments of a group. Every copy that has not been reaped counts, including hedged
+ * copies and losers that are still being killed. A segment that is only waiting for its helper counts once.
+ *
+ * Input:
+ *    struct segment segments[]: the segments of the group.
+ *    int n: the number of segments in the group.
+ *
+ * Output:
+ *    The number of running copies.
+ */
+int count_running(struct segment segments[], int n)
+{
+  int running = 0;
+  for (int i = 0; i < n; i++)
+  {
+    int live = 0;
+    for (int j = 0; j < segments[i].attempt_count; j++)
+    {
+      live += segments[i].attempts[j].live;
+    }
+    if (live == 0 && segments[i].launched && !segments[i].done)
+      live = 1;
+    running += live;
   }
-
-  // No valid command.
-  return 0;
+  return running;
 }
 
 /**
- * Register the arguments given to this program and proceed to the appropriate task.
+ * Update the concurrency limit from the pressure on the host, at most once per control interval. The controller
+ * uses additive increase and multiplicative decrease: if any resource is under pressure, the limit is halved;
+ * otherwise, if the limit is holding segments back, it is raised by one. The pressure is a ten second average, so
+ * after a decrease the limit is held for that long before it can be halved again, giving the average time to see
+ * the effect of the last decrease. Only the automatic mode changes the limit.
  *
  * Input:
- *    int argc: the number of arguments given to the command line.
- *    char *argv[]: an array of the arguments passed to this program.
+ *    int running: the number of copies that are running.
  */
-void register_arguments(int argc, char *argv[])
+void sample_concurrency(int running)
 {
-  if (argc < 0)
-  {
-    // There was an error.
-    print_error_message();
+  if (concurrency.mode != CONCURRENCYAUTO)
+    return;
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (concurrency.sampled && elapsed_usec(&concurrency.last_sample, &now) < CONTROLINTERVALMS * 1000L)
     return;
+  concurrency.sampled = true;
+  concurrency.last_sample = now;
+
+  // Read the pressure on the host.
+  concurrency.cpu = read_pressure("cpu");
+  concurrency.memory = read_pressure("memory");
+  concurrency.io = read_pressure("io");
+  double loads[1];
+  concurrency.load = (getloadavg(loads, 1) == 1) ? loads[0] : -1;
+
+  bool congested = concurrency.cpu > CPUPRESSURELIMIT || concurrency.memory > MEMORYPRESSURELIMIT ||
+                   concurrency.io > IOPRESSURELIMIT || concurrency.load > LOADPERCPULIMIT * concurrency.cpus;
+
+  bool settled = !concurrency.decreased ||
+                 elapsed_usec(&concurrency.last_decrease, &now) >= PRESSUREWINDOWMS * 1000L;
+
+  if (congested && settled && concurrency.limit > 1)
+  {
+    concurrency.limit /= 2;
+    concurrency.decision = "decrease";
+    concurrency.decreases++;
+    concurrency.decreased = true;
+    concurrency.last_decrease = now;
   }
-  else if (argc == 0)
+  else if (!congested && running >= concurrency.limit && concurrency.limit < MAXSEGNUM)
   {
-    // There were no arguments passed.
-    return;
+    concurrency.limit++;
+    concurrency.decision = "increase";
+    concurrency.increases++;
   }
   else
   {
-    // Try to check and register built in commands.
-    int result = register_built_in_commands(argc, argv);
-    if (result != 0)
+    concurrency.decision = "hold";
+  }
+}
+
+/**
+ * Split a line read by a loop into its variables. Leading spaces and tabs are skipped, each variable but the last
+ * gets one field, and the last variable gets the rest of the line. Variables past the end of the line are empty.
+ * The line is split in place.
+ *
+ * Input:
+ *    char *line: the line to split.
+ *    int first: the index of the loop's first variable.
+ *    int vars: the number of variables the loop reads.
+ */
+void split_loop_line(char *line, int first, int vars)
+{
+  char *c = line;
+  for (int i = 0; i < vars; i++)
+  {
+    while (*c == ' ' || *c == '\t')
+      c++;
+    loop_variables[first + i].value = c;
+
+    if (i == vars - 1)
+    {
+      // The last variable gets the rest of the line.
+      char *last = c + strlen(c);
+      while (last > c && isspace((unsigned char)last[-1]))
+        last--;
+      *last = '\0';
+    }
+    else
     {
-      if (result == -1)
-        print_error_message(); // There was an error checking/registering built in commands.
-      return;                  // The commands were executed.
+      c += strcspn(c, " \t");
+      if (*c != '\0')
+        *c++ = '\0';
     }
+  }
+}
+
+/**
+ * Run the body of a loop once. Each line is parsed and registered like a line of the batch file, and the loop
+ * variables are replaced when its groups run. A loop inside the body is run with the lines up to its own 'done' as its body.
+ *
+ * Input:
+ *    const char *body: the text of the body.
+ */
+void run_loop_body(const char *body)
+{
+  const char *line = body;
+  while (*line != '\0')
+  {
+    const char *end = strchrnul(line, '\n');
+    const char *next = (*end == '\0') ? end : end + 1;
 
-    // Check if the program(s) is executable.
-    if (validate_input_format(argc, argv) == -1)
+    // Take the body of a nested loop.
+    char *nested = NULL;
+    if (loop_nesting(line, end - line) == 1)
     {
-      print_error_message();
-      return;
+      const char *inner = next;
+      int depth = 1;
+      while (*next != '\0')
+      {
+        const char *next_end = strchrnul(next, '\n');
+        depth += loop_nesting(next, next_end - next);
+        const char *after = (*next_end == '\0') ? next_end : next_end + 1;
+        if (depth == 0)
+        {
+          nested = strndup(inner, next - inner);
+          next = after;
+          break;
+        }
+        next = after;
+      }
     }
-    else
+
+    // Run the line with input documents of its own, keeping those of the line that holds the loop.
+    int outer_stdin[MAXSEGNUM];
+    for (int i = 0; i < MAXSEGNUM; i++)
     {
-      // Execute the program calls.
-      execute_programs(argc, argv);
+      outer_stdin[i] = segment_stdin[i];
+      segment_stdin[i] = -1;
     }
 
-    return;
+    char *array[MAXARGNUM];
+    int argc = parse_line_text(strndup(line, end - line), array, NULL, segment_stdin, NULL);
+
+    char *outer = loop_body;
+    loop_body = nested;
+    register_arguments(argc, array);
+    loop_body = outer;
+
+    free(nested);
+    close_input_documents();
+    memcpy(segment_stdin, outer_stdin, sizeof(segment_stdin));
+    for (int i = 0; i < argc; i++)
+    {
+      free(array[i]);
+    }
+    line = next;
   }
 }
 
 /**
- * This function will parse input delimited by '&'. This function will check the internal paths for an executable
- * binary for each call of greater than or equal to one arguments delimited by the '&'. If there is a valid path,
- * the program continues. Otherwise, the function halts and returns. A valid input must be delimited by '&'.
- * There should be no empty calls between or after the delimiter. Otherwise, the function returns an error result.
- * Additionally, the function validates whether or not the proper standards for redirecting output are used.
+ * Replace '$?' and '$VAR' in a word, where VAR is a variable of a running loop. The innermost loop's variables are
+ * checked first. Anything else is left as it is.
  *
  * Input:
- *    int argc: the number of arguments given to command line.
- *    char *argv[]: an array of the arguments passed to this program.
+ *    const char *word: the word to expand.
  *
  * Output:
- *    0 - If all program calls were valid and have an executable path.
- *   -1 - If any program calls are invalid.
+ *    The expanded word, which is alloced and should be freed after it is not needed.
  */
-int validate_input_format(int argc, char *argv[])
+char *expand_variables(const char *word)
 {
-  // Create variables.
-  int cnt = 0, current_cnt = 0;
+  char *expanded = NULL;
+  size_t size = 0;
+  FILE *out = open_memstream(&expanded, &size);
+  if (out == NULL)
+    return strdup(word);
 
-  while (cnt < argc + 1)
+  write_expanded_variables(out, word, strlen(word));
+  fclose(out);
+  return expanded;
+}
+
+/**
+ * Write text to a stream, replacing '$?' with the last status and '$VAR' with the value of the loop variable VAR.
+ *
+ * Input:
+ *    FILE *out: the stream to write to.
+ *    const char *text: the text to write.
+ *    size_t len: the length of the text.
+ */
+void write_expanded_variables(FILE *out, const char *text, size_t len)
+{
+  const char *end = text + len;
+  const char *c = text;
+  const char *dollar;
+  while ((dollar = memchr(c, '$', end - c)) != NULL)
   {
-    // Check if the current portion is delimited.
-    if (argv[cnt] == NULL || strcmp(argv[cnt], "&") == 0)
+    fwrite(c, 1, dollar - c, out);
+    c = dollar + 1;
+
+    if (c < end && *c == '?')
     {
-      if (current_cnt > 0) // There are more than 0 arguments.
-      {
-        // Attempt to find the binary.
-        char *fpath = validate_path(argv[cnt - current_cnt]);
+      fprintf(out, "%d", last_status);
+      c++;
+      continue;
+    }
 
-        // Check if it worked.
-        if (fpath == NULL)
-        {
-          return -1;
-        }
-        else
-        {
-          free(fpath);
-        }
+    // Find the name after the '$'.
+    size_t n = 0;
+    while (c + n < end && (isalnum((unsigned char)c[n]) || c[n] == '_'))
+      n++;
 
-        // Check that there is a valid io redirect format.
-        if (validate_io_redirect_format(current_cnt, &argv[cnt - current_cnt]) == -1)
-        {
-          return -1;
-        }
+    const struct loop_variable *var = NULL;
+    for (int j = loop_variable_count - 1; n > 0 && j >= 0 && var == NULL; j--)
+    {
+      if (strlen(loop_variables[j].name) == n && strncmp(loop_variables[j].name, c, n) == 0)
+        var = &loop_variables[j];
+    }
 
-        // Reset the current counts.
-        current_cnt = 0;
-      }
+    if (var != NULL)
+    {
+      fputs(var->value, out);
+      c += n;
     }
     else
     {
-      current_cnt++;
+      fputc('$', out);
     }
-    cnt++;
   }
-
-  return 0;
+  fwrite(c, 1, end - c, out);
 }
 
 /**
- * This function will take a sequence of program arguments and determine if
- * the arguments follow a valid IO redirect format.
+ * Open the output of a streaming built-in command. If the arguments end in '> FILE', the file is created or
+ * truncated and the redirect is taken off the arguments. Compressed files are only written by compressor
+ * processes, so they cannot be the target of a built-in command.
  *
  * Input:
- *    int argc: the number of arguments given to command line.
- *    char *argv[]: an array of the arguments passed to this program.
+ *    int *argc: the number of arguments, which is updated if there is a redirect.
+ *    char *argv[]: the arguments.
  *
  * Output:
- *    1 - If no arguments were passed to the function.
- *    1 - If all program calls use a valid IO redirect format.
- *   -1 - If any program calls are invalid.
+ *    The stream to write to, or NULL if there was an error.
  */
-int validate_io_redirect_format(int argc, char *argv[])
+FILE *open_builtin_output(int *argc, char *argv[])
 {
-  // Variables to validate the redirecting strings.
-  int cnt = 0;
-  int ans = 0;
+  int redir = validate_io_redirect_format(*argc, argv);
+  if (redir == 0)
+    return stdout;
+  if (redir == -1 || has_compressed_suffix(argv[*argc - 1]))
+    return NULL;
 
-  // Iterate through a portion of the array.
-  while (argv[cnt] != NULL && strcmp(argv[cnt], "&") != 0)
+  int fd = open(argv[*argc - 1], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd == -1)
+    return NULL;
+  FILE *out = fdopen(fd, "w");
+  if (out == NULL)
   {
-    // If any argument besides arguments n-1 is a valid redirect strings.
-    if (strcmp(argv[cnt], ">") == 0)
-    {
-      if (cnt == argc - 2 && cnt > 0)
-      {
-        // The format is valid.
-        ans = 1;
-      }
-      else
-      {
-        return -1; // The format is incorrect.
-      }
-    }
-
-    // increment count.
-    ++cnt;
+    close(fd);
+    return NULL;
   }
 
-  // The format is correct.
-  return ans;
+  *argc -= 2;
+  return out;
 }
 
 /**
- * This function executes a single process with the given arguments and argument count. 
- * It will handle the IO redirect if one is specified. This function assumes that the
- * provided arguments are valid and in a valid format. If an error occurs, this process
- * will exit immediatly and IO redirection will be unresolved. Thus, the state is 
- * uncertain in that case.
- * 
+ * Close the output of a streaming built-in command, or flush it if it is standard output, so nothing is left in
+ * the buffer when a child is forked. The commands write with the unlocked stdio calls, since the shell has a
+ * single thread.
+ *
  * Input:
- *    int argc: the number of arguments given to command line.
- *    char *argv[]: an array of the arguments passed to this program.
+ *    FILE *out: the stream that was written to.
  */
-void execute_process(int argc, char *argv[])
+void close_builtin_output(FILE *out)
 {
-  char *temp;
-  int save_out;
-  int out;
+  if (out == stdout)
+    fflush(stdout);
+  else
+    fclose(out);
+}
 
-  // Check if a redirect is necessary.
-  int redir = validate_io_redirect_format(argc, argv);
+/**
+ * Open a file to be read in blocks of lines.
+ *
+ * Input:
+ *    struct line_scanner *sc: the scanner to set up.
+ *    const char *path: the path of the file.
+ *
+ * Output:
+ *    0 - If the file was opened.
+ *   -1 - If there was an error.
+ */
+int open_line_scanner(struct line_scanner *sc, const char *path)
+{
+  sc->fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (sc->fd == -1)
+    return -1;
 
-  if (redir == 1) // If an output file is provided.
+  // The file is read once from start to end.
+  posix_fadvise(sc->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  sc->capacity = SCANBLOCKSIZE;
+  sc->buf = malloc(sc->capacity);
+  if (sc->buf == NULL)
   {
-    // Open the file for output.
-    out = open(argv[argc - 1], O_RDWR | O_CREAT | O_TRUNC, 0600);
-    if (-1 == out) // There was an error opening the file.
+    close(sc->fd);
+    return -1;
+  }
+  sc->start = 0;
+  sc->end = 0;
+  sc->eof = false;
+  return 0;
+}
+
+/**
+ * Hand out the next block of whole lines. The file is read in large chunks and the block ends at the last newline
+ * in the buffer, found with memrchr, so no byte is looked at more than once here. A line longer than the buffer
+ * grows it. At the end of the file, a last line without a newline is its own block. The byte just after a block
+ * always belongs to the buffer, so a caller can end the last line of the block in place.
+ *
+ * Input:
+ *    struct line_scanner *sc: the scanner to read from.
+ *    char **block: where the start of the block is stored.
+ *    size_t *len: where the length of the block is stored.
+ *
+ * Output:
+ *    1 - If a block was read.
+ *    0 - If the end of the file was reached.
+ *   -1 - If there was an error.
+ */
+int next_line_block(struct line_scanner *sc, char **block, size_t *len)
+{
+  while (1)
+  {
+    // Hand out the whole lines in the buffer.
+    char *last = (sc->end > sc->start) ? memrchr(sc->buf + sc->start, '\n', sc->end - sc->start) : NULL;
+    if (last != NULL || (sc->eof && sc->end > sc->start))
     {
-      exit(0); // Check that this is the correct return value.
+      size_t stop = (last != NULL) ? (size_t)(last - sc->buf) + 1 : sc->end;
+      *block = sc->buf + sc->start;
+      *len = stop - sc->start;
+      sc->start = stop;
+      return 1;
     }
+    if (sc->eof)
+      return 0;
 
-    save_out = dup(fileno(stdout));
-    if (-1 == dup2(out, fileno(stdout)))
+    // Keep the partial line at the front, and make room for the rest of it.
+    memmove(sc->buf, sc->buf + sc->start, sc->end - sc->start);
+    sc->end -= sc->start;
+    sc->start = 0;
+    if (sc->end + 1 >= sc->capacity)
     {
-      // Something went wrong.
-      exit(0); // Check that this is the correct return value.
+      char *grown = realloc(sc->buf, sc->capacity * 2);
+      if (grown == NULL)
+        return -1;
+      sc->buf = grown;
+      sc->capacity *= 2;
     }
 
-    // Lastly, restrict the arguments.
-    temp = argv[argc - 2];
-    argv[argc - 2] = NULL;
+    ssize_t nread = read(sc->fd, sc->buf + sc->end, sc->capacity - sc->end - 1);
+    if (nread == -1 && errno == EINTR)
+      continue;
+    if (nread == -1)
+      return -1;
+    if (nread == 0)
+      sc->eof = true;
+    sc->end += nread;
   }
+}
 
-  // Run the process here, given the correct arguments.
-  char *fpath = validate_path(argv[0]); // Should not return NULL at this point.
-  execv(fpath, argv);                   // Execute the process.
-  free(fpath);
-
-  // End the process.
-  if (redir == 1)
-  {
-    argv[argc - 2] = temp;
-    fflush(stdout);
-    close(out);
-    dup2(save_out, fileno(stdout));
-    close(save_out);
-  }
-  exit(0);
+/**
+ * Close a line scanner and free its buffer.
+ *
+ * Input:
+ *    struct line_scanner *sc: the scanner to close.
+ */
+void close_line_scanner(struct line_scanner *sc)
+{
+  close(sc->fd);
+  free(sc->buf);
 }
 
 /**
- * This function will parse any programs delimited by the '&'. This function will fork and run the programs in parallel.
- * This function assumes that all programs delimited by the '&' are valid calls. If no arguments are passed between
- * delimiters, then the function skip that call.
+ * Count how many times a byte appears in a buffer. Eight bytes are compared at a time: after XOR with the byte
+ * repeated, a matching byte is zero, and adding 0x7f to the low seven bits of every byte sets the high bit of each
+ * one that is not, without carrying into the next byte. The high bits left clear are the matches.
  *
  * Input:
- *    int argc: the number of arguments given to command line.
- *    char *argv[]: an array of the arguments passed to this program.
+ *    const char *data: the buffer to search.
+ *    size_t len: the length of the buffer.
+ *    char c: the byte to count.
  *
  * Output:
- *    1 - Always returns 1.
- *
+ *    The number of times the byte appears.
  */
-int execute_programs(int argc, char *argv[])
+size_t count_byte(const char *data, size_t len, char c)
 {
-  int n = 0;
-  int cnt = 0;
-  int current_cnt = 0;
+  const uint64_t lows = 0x7f7f7f7f7f7f7f7fULL;
+  const uint64_t highs = 0x8080808080808080ULL;
+  const uint64_t pattern = 0x0101010101010101ULL * (unsigned char)c;
+  size_t count = 0;
+  size_t i = 0;
 
-  while (cnt < argc + 1)
+  for (; i + 8 <= len; i += 8)
   {
-    if (argv[cnt] == NULL || strcmp(argv[cnt], "&") == 0)
-    {
-      // Block the array.
-      if (argv[cnt] != NULL)
-      {
-        free(argv[cnt]);
-        argv[cnt] = NULL;
-      }
-
-      if (current_cnt > 0) // There is an adequate number of arguments.
-      {
-        // Start child process.
-        pid_t rc;
-        if ((rc = fork()) < 0)
-        {
-          // There was an error.
-          abort();
-        }
-        else if (rc == 0)
-        {
-          // Run the i'th process.
-          execute_process(current_cnt, &argv[cnt - current_cnt]);
-        }
-        else
-        {
-          // Update variables.
-          n++;             // Number of programs grows.
-          current_cnt = 0; // Number of current arguments goes back to zero.
-        }
-      }
-    }
-    else
-    {
-      current_cnt++; // Increment number of current arguments.
-    }
-
-    cnt++; // Increment count;
+    uint64_t word;
+    memcpy(&word, data + i, sizeof(word));
+    uint64_t x = word ^ pattern;
+    uint64_t t = ((x & lows) + lows) | x;
+    count += __builtin_popcountll(~t & highs);
   }
-
-  /* Wait for children to exit. */
-  int status;
-  pid_t pid;
-  while (n > 0)
+  for (; i < len; i++)
   {
-    pid = wait(&status);
-    // To show the state of child processes.
-    // printf("Child with PID %ld exited with status 0x%x.\n", (long)pid, status);
-    --n;
+    count += (data[i] == c);
   }
+  return count;
+}
 
-  // return;
-  return 0;
+/**
+ * Free an array of alloced arguments.
+ *
+ * Input:
+ *    int argc: the number of arguments.
+ *    char *argv[]: the arguments.
+ */
+void free_arguments(int argc, char *argv[])
+{
+  for (int i = 0; i < argc; i++)
+  {
+    free(argv[i]);
+  }
 }
 
 /**
@@ -0,0 +1,3 @@
+#!/bin/bash
+echo start
+if [ -e /tmp/lsh34.flag ]; then echo fast; else touch /tmp/lsh34.flag; sleep 3; echo slow; fi
@@ -0,0 +1 @@
+echo not a binary
@@ -0,0 +1,2 @@
+#!/bin/bash
+echo tag $1 in $(basename "$PWD")